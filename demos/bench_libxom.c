@@ -0,0 +1,814 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <x86intrin.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "xom.h"
+
+#define DEFAULT_ITERATIONS 100000
+#define ITLB_BENCH_SIZE (8ul << 20)
+#define MAX_ALLOC_SAMPLES 2000
+#define NUMA_BENCH_SIZE (32ul << 20)
+#define MAX_BENCH_NODES 8
+#define CACHE_LINE_SIZE 64
+#define MAX_BENCH_THREADS 64
+#define CHURN_LIVE_BUFFERS 64
+#define CHURN_REPORTS 10
+#define STARTUP_MAPPINGS 500
+#define MAX_STARTUP_SAMPLES 200
+
+struct {
+    const char *name;
+    const char *description;
+    int (*run)(unsigned long iterations);
+} typedef benchmark;
+
+// Executes cpuid, which unconditionally causes a VM exit, n times. The exit benchmark copies this into XOM.
+// Vector register clearing overwrites %r14 and %r15, so the compiler has to save them.
+void __attribute__((section(".data"), noinline)) cpuid_loop(unsigned long n) {
+    asm volatile(
+            "1:\n"
+            "xor %%eax, %%eax\n"
+            "cpuid\n"
+            "dec %0\n"
+            "jnz 1b\n"
+            : "+r" (n)
+            :
+            : "rax", "rbx", "rcx", "rdx", "r14", "r15", "memory"
+            );
+}
+void __attribute__((section(".data"))) cpuid_loop_end(void) {}
+
+// Same as cpuid_loop, but survives full register clearing by keeping the counter on the stack below the red zone
+void __attribute__((section(".data"), noinline)) cpuid_loop_full(unsigned long n) {
+    asm volatile(
+            "sub $128, %%rsp\n"
+            "push %0\n"
+            "1:\n"
+            "xor %%eax, %%eax\n"
+            "cpuid\n"
+            "decq (%%rsp)\n"
+            "jnz 1b\n"
+            "add $136, %%rsp\n"
+            :
+            : "r" (n)
+            : "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+              "memory"
+            );
+}
+void __attribute__((section(".data"))) cpuid_loop_full_end(void) {}
+
+static inline uint64_t cycles_begin(void) {
+    _mm_lfence();
+    return __rdtsc();
+}
+
+static inline uint64_t cycles_end(void) {
+    unsigned int aux;
+    uint64_t ret = __rdtscp(&aux);
+    _mm_lfence();
+    return ret;
+}
+
+static void print_cycles(const char *label, uint64_t cycles, unsigned long iterations) {
+    printf("  %-40s %10.1f cycles/exit\n", label, (double) cycles / (double) iterations);
+}
+
+static uint64_t time_cpuid_loop(void (*fn)(unsigned long), unsigned long iterations) {
+    uint64_t start;
+
+    fn(iterations / 10 + 1);
+    start = cycles_begin();
+    fn(iterations);
+    return cycles_end() - start;
+}
+
+// Register footprints measured by the exit benchmark, from the cheapest to the most expensive one
+static const struct {
+    const char *label;
+    unsigned char footprint;
+} exit_classes[] = {
+        {"exit inside marked page (SSE)", XOM_REG_CLEAR_SSE},
+        {"exit inside marked page (AVX)", XOM_REG_CLEAR_AVX},
+        {"exit inside marked page (AVX-512)", XOM_REG_CLEAR_AVX512},
+        {"exit inside marked page (widest)", XOM_REG_CLEAR_WIDEST},
+        {"exit inside marked page (full)", XOM_REG_CLEAR_FULL},
+};
+
+// Copies a cpuid loop into its own XOM page, marks it with footprint and times it, optionally also an exit outside of it
+static int time_marked_loop(const char *label, unsigned char footprint, int time_outside, unsigned long iterations) {
+    void (*loop)(unsigned long) = (footprint & XOM_REG_CLEAR_FULL) ? cpuid_loop_full : cpuid_loop;
+    void *loop_end = (footprint & XOM_REG_CLEAR_FULL) ? (void *) cpuid_loop_full_end : (void *) cpuid_loop_end;
+    void (*xom_loop)(unsigned long);
+    struct xombuf *xbuf;
+    int status;
+
+    xbuf = xom_alloc(PAGE_SIZE);
+    if (!xbuf)
+        return errno;
+    if (xom_write(xbuf, loop, (size_t) loop_end - (size_t) loop, 0) < 0)
+        goto fail;
+    xom_loop = xom_lock(xbuf);
+    if (!xom_loop)
+        goto fail;
+    status = xom_mark_register_clear(xbuf, footprint, 0);
+    if (status < 0) {
+        xom_free(xbuf);
+        return -status;
+    }
+
+    print_cycles(label, time_cpuid_loop(xom_loop, iterations), iterations);
+    if (time_outside)
+        print_cycles("marked page, exit outside of it", time_cpuid_loop(cpuid_loop, iterations), iterations);
+
+    xom_free(xbuf);
+    return 0;
+
+fail:
+    status = errno;
+    xom_free(xbuf);
+    return status;
+}
+
+/*
+ * Measures the cost of a VM exit from user mode (cpuid) in these situations:
+ *  - no page of this process is marked for register clearing,
+ *  - marked pages exist, but the exit happens elsewhere,
+ *  - the exit happens inside a marked page, once for each register footprint.
+ * Other processes in the same domain may already have marked pages, which makes
+ * the first case look like the second one.
+ */
+static int bench_exit(unsigned long iterations) {
+    unsigned int i;
+    int status;
+
+    if (get_xom_mode() != XOM_MODE_SLAT) {
+        puts("  Register clearing requires SLAT-based XOM, skipping");
+        return 0;
+    }
+
+    print_cycles("no marked pages", time_cpuid_loop(cpuid_loop, iterations), iterations);
+
+    for (i = 0; i < sizeof(exit_classes) / sizeof(*exit_classes); i++) {
+        status = time_marked_loop(exit_classes[i].label, exit_classes[i].footprint, !i, iterations);
+        if (status)
+            return status;
+    }
+
+    return 0;
+}
+
+// Fills buf with a chain of jumps that executes one instruction every stride bytes and returns at the end
+static void build_jump_chain(uint8_t *buf, size_t size, size_t stride) {
+    const int32_t rel = (int32_t) (stride - 5);
+    size_t offset;
+
+    memset(buf, 0xcc, size);
+    for (offset = 0; offset + stride < size; offset += stride) {
+        buf[offset] = 0xe9;
+        memcpy(buf + offset + 1, &rel, sizeof(rel));
+    }
+    buf[offset] = 0xc3;
+}
+
+// Counts iTLB misses of this process in user mode, returns -1 if perf events are unavailable
+static int open_itlb_counter(void) {
+    struct perf_event_attr attr = {
+            .type = PERF_TYPE_HW_CACHE,
+            .size = sizeof(attr),
+            .config = PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            .disabled = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+    };
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void time_page_chain(const char *label, void (*chain)(void), unsigned long passes, int perf_fd) {
+    const double pages = (double) (ITLB_BENCH_SIZE / PAGE_SIZE) * (double) passes;
+    uint64_t start, cycles, misses = 0;
+    unsigned long i;
+
+    chain();
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = cycles_begin();
+    for (i = 0; i < passes; i++)
+        chain();
+    cycles = cycles_end() - start;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = 0;
+    }
+
+    printf("  %-40s %10.1f cycles/page", label, (double) cycles / pages);
+    if (perf_fd >= 0)
+        printf(" %8.3f iTLB misses/page", (double) misses / pages);
+    putchar('\n');
+}
+
+/*
+ * Models the instruction fetches of a large migrated binary: a chain of jumps touches every
+ * page of an 8MB region once per pass. The region is executed from ordinary 4K pages and from
+ * a XOM buffer, which libxom backs with 2MB pages (EPT superpages with SLAT, THP with PKU).
+ * Each iteration is one pass over 2048 pages. EPT misses are not visible to the guest, but
+ * show up as more cycles per page.
+ */
+static int bench_itlb(unsigned long iterations) {
+    const unsigned long passes = iterations / 1000 + 1;
+    void (*xom_chain)(void);
+    struct xombuf *xbuf = NULL;
+    uint8_t *chain, *code;
+    int perf_fd, status = 0;
+
+    perf_fd = open_itlb_counter();
+    if (perf_fd < 0)
+        puts("  perf events are unavailable, only measuring cycles");
+
+    code = malloc(ITLB_BENCH_SIZE);
+    chain = mmap(NULL, ITLB_BENCH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!code || chain == MAP_FAILED) {
+        status = ENOMEM;
+        goto exit;
+    }
+    build_jump_chain(code, ITLB_BENCH_SIZE, PAGE_SIZE);
+
+    madvise(chain, ITLB_BENCH_SIZE, MADV_NOHUGEPAGE);
+    memcpy(chain, code, ITLB_BENCH_SIZE);
+    if (mprotect(chain, ITLB_BENCH_SIZE, PROT_READ | PROT_EXEC) < 0) {
+        status = errno;
+        goto exit;
+    }
+    time_page_chain("4K pages, no XOM", (void (*)(void)) chain, passes, perf_fd);
+
+    xbuf = xom_alloc(ITLB_BENCH_SIZE);
+    if (!xbuf || xom_write(xbuf, code, ITLB_BENCH_SIZE, 0) < 0) {
+        status = errno;
+        goto exit;
+    }
+    xom_chain = xom_lock(xbuf);
+    if (!xom_chain) {
+        status = errno;
+        goto exit;
+    }
+    time_page_chain("XOM buffer", xom_chain, passes, perf_fd);
+
+exit:
+    if (xbuf)
+        xom_free(xbuf);
+    if (chain != MAP_FAILED)
+        munmap(chain, ITLB_BENCH_SIZE);
+    free(code);
+    if (perf_fd >= 0)
+        close(perf_fd);
+    return status;
+}
+
+static int compare_cycles(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_percentiles(const char *label, uint64_t *samples, unsigned long n) {
+    qsort(samples, n, sizeof(*samples), compare_cycles);
+    printf("  %-40s p50 %10lu  p90 %10lu  p99 %10lu cycles\n", label, (unsigned long) samples[n / 2],
+           (unsigned long) samples[n * 9 / 10], (unsigned long) samples[n * 99 / 100]);
+}
+
+// Times n allocations of size bytes, freeing each one outside of the timed region
+static int time_allocations(const char *label, size_t size, int subpages, uint64_t *samples, unsigned long n) {
+    struct xom_subpages *sbuf = NULL;
+    struct xombuf *xbuf = NULL;
+    uint64_t start;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        start = cycles_begin();
+        if (subpages)
+            sbuf = xom_alloc_subpages(size);
+        else
+            xbuf = xom_alloc(size);
+        samples[i] = cycles_end() - start;
+        if (!sbuf && !xbuf)
+            return errno;
+        if (subpages)
+            xom_free_all_subpages(sbuf);
+        else
+            xom_free(xbuf);
+        sbuf = NULL;
+        xbuf = NULL;
+    }
+
+    print_percentiles(label, samples, n);
+    return 0;
+}
+
+/*
+ * Measures the latency of xom_alloc and xom_alloc_subpages as percentiles, since a slow tail
+ * matters more than the mean to a caller that allocates on demand. With SLAT-based XOM, the
+ * page allocation happens in the mmap of modxom, which takes pre-zeroed pages from its reserve
+ * while it lasts. Each iteration is 100 allocations, up to 2000 per size.
+ */
+static int bench_alloc(unsigned long iterations) {
+    static const struct {
+        const char *label;
+        size_t size;
+        int subpages;
+    } sizes[] = {
+            {"xom_alloc (4K)", PAGE_SIZE, 0},
+            {"xom_alloc (64K)", 16 * PAGE_SIZE, 0},
+            {"xom_alloc (2M)", 512 * PAGE_SIZE, 0},
+            {"xom_alloc_subpages (4K)", PAGE_SIZE, 1},
+    };
+    const unsigned long n = iterations / 100 + 1 < MAX_ALLOC_SAMPLES ? iterations / 100 + 1 : MAX_ALLOC_SAMPLES;
+    uint64_t *samples;
+    unsigned int i;
+    int status = 0;
+
+    samples = malloc(n * sizeof(*samples));
+    if (!samples)
+        return ENOMEM;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes) && !status; i++) {
+        if (sizes[i].subpages && get_xom_mode() != XOM_MODE_SLAT) {
+            puts("  Subpages require SLAT-based XOM, skipping xom_alloc_subpages");
+            continue;
+        }
+        status = time_allocations(sizes[i].label, sizes[i].size, sizes[i].subpages, samples, n);
+    }
+
+    free(samples);
+    return status;
+}
+
+struct numa_worker {
+    const uint8_t *code;
+    struct xombuf *xbuf;
+    void (*chain)(void);
+    unsigned long passes;
+    uint64_t cycles;
+    int status;
+};
+
+// Allocates and locks the chain from a thread pinned to the allocating node
+static void *numa_alloc_worker(void *arg) {
+    struct numa_worker *worker = arg;
+
+    worker->xbuf = xom_alloc(NUMA_BENCH_SIZE);
+    if (!worker->xbuf || xom_write(worker->xbuf, worker->code, NUMA_BENCH_SIZE, 0) < 0) {
+        worker->status = errno;
+        return NULL;
+    }
+    worker->chain = xom_lock(worker->xbuf);
+    if (!worker->chain)
+        worker->status = errno;
+    return NULL;
+}
+
+static void *numa_exec_worker(void *arg) {
+    struct numa_worker *worker = arg;
+    uint64_t start;
+    unsigned long i;
+
+    worker->chain();
+    start = cycles_begin();
+    for (i = 0; i < worker->passes; i++)
+        worker->chain();
+    worker->cycles = cycles_end() - start;
+    return NULL;
+}
+
+static int run_pinned(int cpu, void *(*fn)(void *), struct numa_worker *worker) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t cpus;
+    int status;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    status = pthread_create(&thread, &attr, fn, worker);
+    pthread_attr_destroy(&attr);
+    if (status)
+        return status;
+    pthread_join(thread, NULL);
+    return worker->status;
+}
+
+// Picks the first CPU of each NUMA node that this process may run on, returns the number of nodes found
+static int find_node_cpus(int node_cpus[MAX_BENCH_NODES]) {
+    unsigned int cpu, node;
+    cpu_set_t allowed, one;
+    int i, nodes = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return 0;
+    for (i = 0; i < MAX_BENCH_NODES; i++)
+        node_cpus[i] = -1;
+
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &allowed))
+            continue;
+        CPU_ZERO(&one);
+        CPU_SET(i, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) < 0 || syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+            continue;
+        if (node < MAX_BENCH_NODES && node_cpus[node] < 0) {
+            node_cpus[node] = i;
+            nodes++;
+        }
+    }
+
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+    return nodes;
+}
+
+/*
+ * Measures instruction fetch locality of XOM on NUMA systems. For each node, a thread pinned to
+ * one of its CPUs allocates a 32MB chain of jumps that touches every cache line, so that fetches
+ * miss the last level cache. Threads pinned to each node then execute it, which shows the cost of
+ * fetching code from a remote node. Each iteration is 10000 passes over the chain.
+ */
+static int bench_numa(unsigned long iterations) {
+    struct numa_worker worker = {.passes = iterations / 10000 + 1};
+    int node_cpus[MAX_BENCH_NODES];
+    int alloc_node, exec_node, status = 0;
+    char label[64];
+    uint8_t *code;
+
+    if (find_node_cpus(node_cpus) < 2)
+        puts("  Only one NUMA node is available, all fetches are local");
+
+    code = malloc(NUMA_BENCH_SIZE);
+    if (!code)
+        return ENOMEM;
+    build_jump_chain(code, NUMA_BENCH_SIZE, CACHE_LINE_SIZE);
+    worker.code = code;
+
+    for (alloc_node = 0; alloc_node < MAX_BENCH_NODES && !status; alloc_node++) {
+        if (node_cpus[alloc_node] < 0)
+            continue;
+        status = run_pinned(node_cpus[alloc_node], numa_alloc_worker, &worker);
+
+        for (exec_node = 0; exec_node < MAX_BENCH_NODES && !status; exec_node++) {
+            if (node_cpus[exec_node] < 0)
+                continue;
+            status = run_pinned(node_cpus[exec_node], numa_exec_worker, &worker);
+            if (status)
+                break;
+            snprintf(label, sizeof(label), "XOM on node %d, executed on node %d", alloc_node, exec_node);
+            printf("  %-40s %10.1f cycles/line\n", label,
+                   (double) worker.cycles / (double) (NUMA_BENCH_SIZE / CACHE_LINE_SIZE * worker.passes));
+        }
+
+        if (worker.xbuf)
+            xom_free(worker.xbuf);
+        worker.xbuf = NULL;
+    }
+
+    free(code);
+    return status;
+}
+
+struct scaling_worker {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    unsigned long iterations;
+    int use_subpages;
+    int status;
+    double begin, end;
+};
+
+static double seconds_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Fills and frees one subpage at a time on a subpage array of its own, or only queries the XOM mode
+static void *scaling_worker_run(void *arg) {
+    struct scaling_worker *worker = arg;
+    const uint8_t code[SUBPAGE_SIZE] = {0xc3};
+    struct xom_subpages *subpages = NULL;
+    unsigned long i;
+    void *fn;
+
+    // The first allocation stays, so that freeing the others never releases the whole array
+    if (worker->use_subpages) {
+        subpages = xom_alloc_subpages(PAGE_SIZE);
+        if (!subpages || !xom_fill_and_lock_subpages(subpages, sizeof(code), code))
+            worker->status = errno ? errno : ENOMEM;
+    }
+    pthread_barrier_wait(worker->start);
+    if (worker->status)
+        return NULL;
+
+    worker->begin = seconds_now();
+    for (i = 0; i < worker->iterations; i++) {
+        if (!worker->use_subpages) {
+            if (get_xom_mode() == XOM_MODE_UNSUPPORTED)
+                worker->status = ENOTSUP;
+            continue;
+        }
+        fn = xom_fill_and_lock_subpages(subpages, sizeof(code), code);
+        if (!fn) {
+            worker->status = errno;
+            break;
+        }
+        xom_free_subpages(subpages, fn);
+    }
+    worker->end = seconds_now();
+
+    if (subpages)
+        xom_free_all_subpages(subpages);
+    return NULL;
+}
+
+static int time_scaling(const char *label, unsigned int threads, int use_subpages, unsigned long iterations) {
+    struct scaling_worker workers[MAX_BENCH_THREADS];
+    pthread_barrier_t start;
+    unsigned int i, started;
+    double begin = 0, end = 0;
+    int status = 0;
+
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (started = 0; started < threads; started++) {
+        workers[started] = (struct scaling_worker) {
+                .start = &start,
+                .iterations = iterations,
+                .use_subpages = use_subpages,
+        };
+        if (pthread_create(&workers[started].thread, NULL, scaling_worker_run, &workers[started]))
+            break;
+    }
+    // Threads that could not be created would leave the others waiting at the barrier forever
+    if (started < threads)
+        abort();
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].status)
+            status = workers[i].status;
+        if (!i || workers[i].begin < begin)
+            begin = workers[i].begin;
+        if (workers[i].end > end)
+            end = workers[i].end;
+    }
+    pthread_barrier_destroy(&start);
+
+    if (!status)
+        printf("  %-28s %2u threads %10.2f Mops/s\n", label, threads,
+               (double) iterations * threads / (end - begin) * 1e-6);
+    return status;
+}
+
+/*
+ * Measures how libxom calls scale with the number of threads. Each thread either queries the XOM
+ * mode, which takes no lock, or fills and frees subpages of its own subpage array, which only
+ * takes that array's lock. Each iteration is one call per thread.
+ */
+static int bench_threads(unsigned long iterations) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads;
+    int status;
+
+    for (threads = 1; threads <= MAX_BENCH_THREADS && threads <= cpus; threads *= 2) {
+        status = time_scaling("get_xom_mode", threads, 0, iterations);
+        if (status)
+            return status;
+    }
+    for (threads = 1; threads <= MAX_BENCH_THREADS && threads <= cpus; threads *= 2) {
+        status = time_scaling("fill and free subpages", threads, 1, iterations);
+        if (status)
+            return status;
+    }
+    return 0;
+}
+
+// Counts the lines of /proc/self/maps, one per VMA
+static long count_vmas(void) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    long vmas = 0;
+    int c;
+
+    if (!maps)
+        return -1;
+    while ((c = getc(maps)) != EOF)
+        vmas += c == '\n';
+    fclose(maps);
+    return vmas;
+}
+
+// Replaces the buffer in slot with a new, locked one of a random size between 4KB and 64KB at *address
+static int churn_replace(struct xombuf **slot, void **address, unsigned int *seed, uint64_t *alloc_cycles,
+                         uint64_t *free_cycles) {
+    const size_t size = PAGE_SIZE * (1 + rand_r(seed) % 16);
+    uint64_t start;
+
+    if (*slot) {
+        start = cycles_begin();
+        xom_free(*slot);
+        *free_cycles = cycles_end() - start;
+    }
+
+    start = cycles_begin();
+    *slot = xom_alloc(size);
+    *alloc_cycles = cycles_end() - start;
+    if (!*slot || xom_write(*slot, "\xc3", 1, 0) < 0 || !(*address = xom_lock(*slot)))
+        return errno ? errno : ENOMEM;
+    return 0;
+}
+
+// Distance between the lowest and the highest live buffer, which grows if freed address space is not reused
+static double live_span_mb(void *const *addresses, unsigned int n) {
+    uintptr_t low = UINTPTR_MAX, high = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if ((uintptr_t) addresses[i] < low)
+            low = (uintptr_t) addresses[i];
+        if ((uintptr_t) addresses[i] > high)
+            high = (uintptr_t) addresses[i];
+    }
+    return (double) (high - low) / (double) (1 << 20);
+}
+
+/*
+ * Models a long-running process that keeps replacing XOM buffers. 64 locked buffers of random
+ * sizes stay alive, and each cycle frees a random one and allocates a new one in its place. Ten
+ * times over the run, the number of VMAs of the process and the address range spanned by the live
+ * buffers are printed together with the latency percentiles of the allocations and frees since
+ * the last report. Each iteration is one cycle.
+ */
+static int bench_churn(unsigned long iterations) {
+    struct xombuf *live[CHURN_LIVE_BUFFERS] = {NULL};
+    void *addresses[CHURN_LIVE_BUFFERS];
+    const unsigned long interval = iterations / CHURN_REPORTS + 1;
+    uint64_t *alloc_samples, *free_samples, unused;
+    unsigned long i, n = 0;
+    unsigned int slot, seed = 1;
+    int status = 0;
+
+    alloc_samples = malloc(interval * sizeof(*alloc_samples));
+    free_samples = malloc(interval * sizeof(*free_samples));
+    if (!alloc_samples || !free_samples) {
+        status = ENOMEM;
+        goto exit;
+    }
+
+    for (i = 0; i < CHURN_LIVE_BUFFERS && !status; i++)
+        status = churn_replace(&live[i], &addresses[i], &seed, &unused, &unused);
+    printf("  %-40s %10ld\n", "VMAs before churning", count_vmas());
+
+    for (i = 0; i < iterations && !status; i++) {
+        slot = rand_r(&seed) % CHURN_LIVE_BUFFERS;
+        status = churn_replace(&live[slot], &addresses[slot], &seed, &alloc_samples[n], &free_samples[n]);
+        if (++n < interval && i + 1 < iterations)
+            continue;
+        printf("  after %lu cycles: %ld VMAs, live buffers span %.1f MB\n", i + 1, count_vmas(),
+               live_span_mb(addresses, CHURN_LIVE_BUFFERS));
+        print_percentiles("xom_alloc", alloc_samples, n);
+        print_percentiles("xom_free", free_samples, n);
+        n = 0;
+    }
+
+exit:
+    for (i = 0; i < CHURN_LIVE_BUFFERS; i++) {
+        if (live[i])
+            xom_free(live[i]);
+    }
+    free(alloc_samples);
+    free(free_samples);
+    return status;
+}
+
+// Migrates all code in a child process and reports how many cycles it took through fd
+static void startup_child(int fd) {
+    uint64_t start, cycles;
+
+    start = cycles_begin();
+    if (xom_migrate_all_code() < 0)
+        _exit(1);
+    cycles = cycles_end() - start;
+    _exit(write(fd, &cycles, sizeof(cycles)) == sizeof(cycles) ? 0 : 1);
+}
+
+/*
+ * Measures what LIBXOM_LOCK=all costs at startup, that is finding all code in /proc/self/maps
+ * and migrating it to XOM, in a process with 500 additional mappings. Every sample is a forked
+ * child, as code can only be migrated once per process. Each iteration is 1000 children, up to 200.
+ */
+static int bench_startup(unsigned long iterations) {
+    const unsigned long n = iterations / 1000 ? (iterations / 1000 < MAX_STARTUP_SAMPLES ?
+                                                  iterations / 1000 : MAX_STARTUP_SAMPLES) : 1;
+    uint64_t samples[MAX_STARTUP_SAMPLES];
+    unsigned long i;
+    int pipe_fds[2], child_status, status = 0;
+    uint8_t *mappings;
+    pid_t pid;
+
+    // Alternating protections keep the kernel from merging the pages into fewer VMAs
+    mappings = mmap(NULL, STARTUP_MAPPINGS * PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mappings == MAP_FAILED)
+        return errno;
+    for (i = 0; i < STARTUP_MAPPINGS; i += 2)
+        mprotect(mappings + i * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE);
+    printf("  %-40s %10ld\n", "VMAs of each child", count_vmas());
+
+    if (pipe(pipe_fds) < 0) {
+        status = errno;
+        goto exit;
+    }
+
+    for (i = 0; i < n && !status; i++) {
+        pid = fork();
+        if (pid < 0) {
+            status = errno;
+            break;
+        }
+        if (!pid)
+            startup_child(pipe_fds[1]);
+        if (waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) ||
+            read(pipe_fds[0], &samples[i], sizeof(*samples)) != sizeof(*samples))
+            status = ECHILD;
+    }
+    if (!status)
+        print_percentiles("migrate all code", samples, n);
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+exit:
+    munmap(mappings, STARTUP_MAPPINGS * PAGE_SIZE);
+    return status;
+}
+
+static const benchmark benchmarks[] = {
+        {"exit", "VM exit overhead of register clearing", bench_exit},
+        {"itlb", "Instruction fetch cost of a large XOM region", bench_itlb},
+        {"alloc", "Latency percentiles of XOM allocations", bench_alloc},
+        {"numa", "Instruction fetch cost of XOM on local and remote NUMA nodes", bench_numa},
+        {"threads", "Throughput of libxom calls from several threads", bench_threads},
+        {"churn", "Address space growth and latency when buffers are replaced", bench_churn},
+        {"startup", "Cost of migrating all code at startup with many mappings", bench_startup},
+};
+
+static void usage(const char *prog) {
+    unsigned int i;
+
+    printf("Usage: %s <benchmark> [iterations]\n\nBenchmarks:\n", prog);
+    for (i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++)
+        printf("  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int i;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    int status;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        iterations = strtoul(argv[2], NULL, 0);
+    if (!iterations)
+        iterations = DEFAULT_ITERATIONS;
+
+    if (get_xom_mode() == XOM_MODE_UNSUPPORTED) {
+        puts("XOM is not supported on your system!");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        if (strcmp(argv[1], benchmarks[i].name) != 0)
+            continue;
+        printf("%s (%lu iterations):\n", benchmarks[i].name, iterations);
+        status = benchmarks[i].run(iterations);
+        if (status)
+            fprintf(stderr, "%s failed: %s\n", benchmarks[i].name, strerror(status));
+        return status;
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -8,11 +8,16 @@
 #include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <link.h>
+#include <fnmatch.h>
 #include <immintrin.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <stddef.h>
 #include <sys/syscall.h>
 #include <cpuid.h>
@@ -28,49 +33,123 @@
 #define LIBXOM_ENVVAR           "LIBXOM_LOCK"
 #define LIBXOM_ENVVAR_LOCK_ALL  "all"
 #define LIBXOM_ENVVAR_LOCK_LIBS "libs"
+#define LIBXOM_ENVVAR_LOCK_LAZY "lazy"
 
 #define TEXT_TYPE_EXECUTABLE    1
 #define TEXT_TYPE_SHARED        (1 << 1)
 #define TEXT_TYPE_VDSO          (1 << 2)
+#define TEXT_TYPE_LAZY          (1 << 3)
+#define TEXT_TYPE_EXCLUDED      (1 << 4)
 
 #define PAGE_SIZE               0x1000
 #define PAGE_SHIFT              12
-#ifndef MAX_ORDER
-#define MAX_ORDER               11
-#endif
-#define ALLOC_CHUNK_SIZE        ((1 << (MAX_ORDER - 1)) << PAGE_SHIFT)
 
 #define SIZE_CEIL(S)            ((((S) >> PAGE_SHIFT) + ((S) & (PAGE_SIZE - 1) ? 1 : 0) ) << PAGE_SHIFT)
+#define SUPERPAGE_CEIL(S)       (((S) + XOM_SUPERPAGE_SIZE - 1) & ~((size_t) XOM_SUPERPAGE_SIZE - 1))
 #define min(x, y)               ((x) < (y) ? (x) : (y))
 #define countof(X)              (sizeof(X) / sizeof(*(X)))
+#define SUBPAGES_PER_PAGE       (PAGE_SIZE / SUBPAGE_SIZE)
+#define HEADERS_PER_SLAB        64
+#define BITMAP_WORDS(N)         (((N) + 63) / 64)
+#define test_page_bit(B, I)     ((B)[(I) / 64] & (1ull << ((I) % 64)))
+#define set_page_bit(B, I)      ((B)[(I) / 64] |= (1ull << ((I) % 64)))
+#define PAGEMAP_PRESENT         (1ull << 63)
+#define PAGEMAP_SWAPPED         (1ull << 62)
+#define PAGEMAP_FILE            (1ull << 61)
+#define LAZY_CHUNK_PAGES        64
+#define LAZY_CHUNK_SIZE         (LAZY_CHUNK_PAGES * PAGE_SIZE)
+#define PF_INSTRUCTION_FETCH    0x10
 
 extern char **__environ;
 
+// Operations on one xombuf or xom_subpages object only take the object's own lock
 struct xombuf {
+    pthread_mutex_t lock;
     void *address;
     size_t allocated_size;
     pid_t pid;
+    uint64_t *marked_pages;           // Pages marked for register clearing, allocated on first use
     uint8_t locked;
-    uint8_t marked;
     uint8_t xom_mode;
+    uint8_t va_owned;                 // The address range came from the XOM address space allocator
 } typedef _xombuf, *p_xombuf;
 
 struct xom_subpages {
+    pthread_mutex_t lock;
     void *address;
+    size_t mapped_size;
     uint8_t xom_mode;
+    uint8_t va_owned;
     uint32_t *lock_status;
+    uint32_t *allocation_ends;        // Per page, marks the last subpage of each allocation
     size_t num_subpages;
-    int8_t references;
+    size_t free_subpages;             // Number of subpages in usable pages that are not locked
+    unsigned int num_pages;           // Pages that are entirely made up of subpages, the only ones in use
+    unsigned int first_free_page;     // No page below this one has a free subpage
+    int32_t references;
 } typedef _xom_subpages, *p_xom_subpages;
 
+// Headers of XOM buffers and subpage arrays come from slabs and are recycled through a free list
+union xom_header {
+    union xom_header *next_free;
+    _xombuf xombuf;
+    _xom_subpages subpages;
+};
+
+// A range of XOM address space that was freed and can be handed out again
+struct {
+    uintptr_t start;
+    size_t size;
+} typedef va_range;
+
 // Describes an executable memory region
 struct {
     char *text_base;                  // Start of memory region, must be page-aligned
     char *text_end;                   // End of memory region, must be page-aligned
     unsigned char type;               // Type of memory region (main executable, shared library or libc)
     unsigned char jump_into_backup;   // Do we have to jump into backup code when unmapping this region?
+    int source_fd;                    // The file the code was mapped from, or -1 if it must be copied
+    off_t file_offset;                // Offset of text_base in source_fd
 } typedef text_region;
 
+// Code that is migrated on its first execution, in chunks of LAZY_CHUNK_PAGES pages
+struct {
+    char *text_base;
+    char *text_end;
+    uint64_t *migrated_chunks;        // Bitmap of the chunks that are in XOM already
+} typedef lazy_region;
+
+// The fields of a line of /proc/self/maps that code migration needs
+struct {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t offset;
+    uintptr_t dev_major;
+    uintptr_t dev_minor;
+    uintptr_t inode;
+    const char *path;                 // NULL if the line did not fit into the read buffer
+} typedef maps_entry;
+
+// Code that was migrated to XOM. scan is the last scan of the loaded objects that found it
+struct {
+    uintptr_t start;
+    uintptr_t end;
+    unsigned int scan;
+} typedef migrated_range;
+
+// State of a dl_iterate_phdr walk that collects code which is not yet in XOM
+struct {
+    text_region *regions;
+    size_t count;
+    size_t capacity;
+    unsigned long long adds;          // Objects loaded and unloaded so far, as seen by the walk
+    unsigned long long subs;
+    unsigned long vdso_base;
+    unsigned int skip_type;
+    unsigned char first;              // The next object is the main executable
+    unsigned char unchanged;          // Nothing was loaded or unloaded since the last walk
+} typedef code_scan;
+
 int32_t xomfd = -1;
 int subpage_pkey = -1;
 
@@ -80,16 +159,48 @@ static pthread_mutexattr_t full_reg_clear_lock_attr;
 static __sighandler_t old_sig_handler;
 
 static volatile uint8_t initialized = 0;
+// Protects the process-wide state: the XOM mode and code migration
 static pthread_mutex_t lib_lock;
-static unsigned int xom_mode = XOM_MODE_UNSUPPORTED;
+static volatile unsigned int xom_mode = XOM_MODE_UNSUPPORTED;
+// Protects the XOM address space, its free ranges and the header free list
+static pthread_mutex_t va_lock = PTHREAD_MUTEX_INITIALIZER;
 static void *xom_base_addr = NULL;
-static unsigned char migrate_dlopen = 0;
+static va_range *va_free_ranges = NULL;
+static size_t va_num_free = 0, va_free_capacity = 0;
+static union xom_header *free_headers = NULL;
+// TEXT_TYPE_* of code loaded by dlopen that is not migrated, 0 if no such code is migrated at all
+static unsigned int migrate_dlopen = 0;
+// Sorted by address. Like the rest of the migration state, it is protected by lib_lock
+static migrated_range *migrated = NULL;
+static size_t num_migrated = 0, migrated_capacity = 0;
+static unsigned int migration_scan = 0;
+static unsigned long long loaded_adds = 0, loaded_subs = 0;
+// Patterns from the list after the mode in LIBXOM_LOCK, set once by the constructor
+static char **migration_patterns = NULL;
+static size_t num_migration_patterns = 0;
+static uint8_t has_include_patterns = 0;
+// State of LIBXOM_LOCK=lazy. The fault handler cannot take mutexes, so the spinlock protects it
+static lazy_region *lazy_regions = NULL;
+static size_t num_lazy_regions = 0;
+static char *lazy_backup = NULL;
+static struct sigaction lazy_old_action;
+static sigset_t lazy_fork_mask;
+static volatile uint8_t lazy_lock = 0;
+static volatile uint8_t lazy_handler_installed = 0;
 static pid_t libxom_pid = 0;
 
 static void *(*dlopen_original)(const char *, int) = NULL;
 
 static void *(*dlmopen_original)(Lmid_t, const char *, int) = NULL;
 
+static int (*sigaction_original)(int, const struct sigaction *, struct sigaction *) = NULL;
+
+static __sighandler_t (*signal_original)(int, __sighandler_t) = NULL;
+
+static int (*sigprocmask_original)(int, const sigset_t *, sigset_t *) = NULL;
+
+static int (*pthread_sigmask_original)(int, const sigset_t *, sigset_t *) = NULL;
+
 #define wrap_call(T, F) {           \
     T r;                            \
     __libxom_prologue();            \
@@ -98,6 +209,14 @@ static void *(*dlmopen_original)(Lmid_t, const char *, int) = NULL;
     return r;                       \
 }
 
+#define wrap_object_call(T, O, F) { \
+    T r;                            \
+    pthread_mutex_lock(&(O)->lock); \
+    r = F;                          \
+    pthread_mutex_unlock(&(O)->lock); \
+    return r;                       \
+}
+
 static inline void unblock_signal(const int signum) {
     sigset_t sigs;
     sigemptyset(&sigs);
@@ -151,22 +270,106 @@ static uint8_t is_pku_supported(void) {
     return (uint8_t) (c >> 3) & 1;
 }
 
-static void __libxom_prologue() {
+static inline void __libxom_prologue() {
     pthread_mutex_lock(&lib_lock);
-    if (xomfd >= 0 && libxom_pid != getpid()) {
+}
+
+static inline void __libxom_epilogue() {
+    pthread_mutex_unlock(&lib_lock);
+}
+
+/*
+ * Only the shared library interposes the signal functions. A static libxom is linked against libc
+ * directly, so it calls the functions of libc.
+ */
+static void resolve_signal_functions(void) {
+#if defined(LIBXOM_SHARED) && (defined(__x86_64__) || defined(_M_X64))
+    sigaction_original = dlsym(RTLD_NEXT, "sigaction");
+    if (sigaction_original == sigaction)
+        sigaction_original = NULL;
+    signal_original = dlsym(RTLD_NEXT, "signal");
+    if (signal_original == signal)
+        signal_original = NULL;
+    sigprocmask_original = dlsym(RTLD_NEXT, "sigprocmask");
+    if (sigprocmask_original == sigprocmask)
+        sigprocmask_original = NULL;
+    pthread_sigmask_original = dlsym(RTLD_NEXT, "pthread_sigmask");
+    if (pthread_sigmask_original == pthread_sigmask)
+        pthread_sigmask_original = NULL;
+#else
+    sigaction_original = sigaction;
+    signal_original = signal;
+    sigprocmask_original = sigprocmask;
+    pthread_sigmask_original = pthread_sigmask;
+#endif
+}
+
+/*
+ * lazy_lock is taken by the fault handler, so no other signal handler may run on the thread that
+ * holds it. If that handler executed code that is not migrated yet, it would fault with the lock held.
+ */
+static void lock_lazy(sigset_t *old_mask) {
+    sigset_t all_signals;
+
+    sigfillset(&all_signals);
+    sigprocmask_original(SIG_BLOCK, &all_signals, old_mask);
+    while (__atomic_test_and_set(&lazy_lock, __ATOMIC_ACQUIRE));
+}
+
+static void unlock_lazy(const sigset_t *old_mask) {
+    __atomic_clear(&lazy_lock, __ATOMIC_RELEASE);
+    sigprocmask_original(SIG_SETMASK, old_mask, NULL);
+}
+
+static void libxom_atfork_prepare(void) {
+    pthread_mutex_lock(&lib_lock);
+    pthread_mutex_lock(&va_lock);
+    lock_lazy(&lazy_fork_mask);
+}
+
+static void libxom_atfork_parent(void) {
+    unlock_lazy(&lazy_fork_mask);
+    pthread_mutex_unlock(&va_lock);
+    pthread_mutex_unlock(&lib_lock);
+}
+
+// modxom state belongs to the open file, so the child needs a file of its own for new XOM buffers
+static void libxom_atfork_child(void) {
+    if (xomfd >= 0) {
         close(xomfd);
         xomfd = open(XOM_FILE, O_RDWR);
-        libxom_pid = getpid();
     }
+    libxom_pid = getpid();
+    unlock_lazy(&lazy_fork_mask);
+    pthread_mutex_unlock(&va_lock);
+    pthread_mutex_unlock(&lib_lock);
 }
 
-static inline void __libxom_epilogue() {
-    pthread_mutex_unlock(&lib_lock);
+/**
+ * Issue a command for a whole modxom mapping
+ *
+ * @param address The start of the mapping
+ * @param size The size of the mapping in bytes
+ * @param cmd The MODXOM_CMD_* command to issue
+ * @returns 0 upon success, a negative value otherwise
+*/
+static int xom_cmd_region(void *address, size_t size, uint32_t cmd) {
+    modxom_cmd mcmd = {
+            .cmd = cmd,
+            .num_pages = (uint32_t) (SIZE_CEIL(size) >> PAGE_SHIFT),
+            .base_addr = (uint64_t) (uintptr_t) address
+    };
+
+    return write(xomfd, &mcmd, sizeof(mcmd)) < 0 ? -1 : 0;
 }
 
 #if (defined(__x86_64__) || defined(_M_X64))
 
-static int migrate_skip_type(unsigned int);
+static int migrate_new_code(void);
+
+static int set_lazy_handler(void);
+
+static inline int migrate_all_code_internal();
 
 void *dlopen(const char *filename, int flags) {
     void *ret;
@@ -176,8 +379,11 @@ void *dlopen(const char *filename, int flags) {
     ret = dlopen_original(filename, flags);
     if (!migrate_dlopen)
         return ret;
-    if (ret)
-        migrate_skip_type(TEXT_TYPE_VDSO);
+    if (ret) {
+        __libxom_prologue();
+        migrate_new_code();
+        __libxom_epilogue();
+    }
     return ret;
 }
 
@@ -189,89 +395,345 @@ void *dlmopen(Lmid_t lmid, const char *filename, int flags) {
     ret = dlmopen_original(lmid, filename, flags);
     if (!migrate_dlopen)
         return ret;
-    if (ret)
-        migrate_skip_type(TEXT_TYPE_VDSO);
+    if (ret) {
+        __libxom_prologue();
+        migrate_new_code();
+        __libxom_epilogue();
+    }
     return ret;
 }
 
+#ifdef LIBXOM_SHARED
+
+/*
+ * With LIBXOM_LOCK=lazy, the fault handler that migrates code must stay installed. SIGSEGV handlers
+ * of the application become the handler that it forwards all other faults to, and the fault handler
+ * is reinstalled with their mask and flags. Handlers of other signals may run lazily migrated code,
+ * so they must not block SIGSEGV.
+ * These functions may be called by constructors that run before libxom's.
+ */
+int sigaction(int signum, const struct sigaction *act, struct sigaction *oldact) {
+    struct sigaction allowed;
+    sigset_t old_mask;
+    int status = 0;
+
+    if (!sigaction_original)
+        resolve_signal_functions();
+    if (!sigaction_original) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if (!lazy_handler_installed)
+        return sigaction_original(signum, act, oldact);
+
+    if (signum != SIGSEGV) {
+        if (act && sigismember(&act->sa_mask, SIGSEGV) == 1) {
+            allowed = *act;
+            sigdelset(&allowed.sa_mask, SIGSEGV);
+            act = &allowed;
+        }
+        return sigaction_original(signum, act, oldact);
+    }
+
+    lock_lazy(&old_mask);
+    if (oldact)
+        *oldact = lazy_old_action;
+    if (act) {
+        lazy_old_action = *act;
+        status = set_lazy_handler();
+    }
+    unlock_lazy(&old_mask);
+    return status;
+}
+
+__sighandler_t signal(int signum, __sighandler_t handler) {
+    struct sigaction action = {.sa_handler = handler, .sa_flags = SA_RESTART}, old_action;
+
+    if (!signal_original)
+        resolve_signal_functions();
+    if (!signal_original) {
+        errno = ENOSYS;
+        return SIG_ERR;
+    }
+    if (signum != SIGSEGV || !lazy_handler_installed)
+        return signal_original(signum, handler);
+
+    if (sigaction(signum, &action, &old_action) < 0)
+        return SIG_ERR;
+    return old_action.sa_handler;
+}
+
+// The kernel kills a thread that faults with SIGSEGV blocked, so lazily migrated code requires it to be unblocked
+static const sigset_t *allow_lazy_faults(int how, const sigset_t *set, sigset_t *allowed) {
+    if (!set || how == SIG_UNBLOCK || !lazy_handler_installed || sigismember(set, SIGSEGV) != 1)
+        return set;
+
+    *allowed = *set;
+    sigdelset(allowed, SIGSEGV);
+    return allowed;
+}
+
+int sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    sigset_t allowed;
+
+    if (!sigprocmask_original)
+        resolve_signal_functions();
+    if (!sigprocmask_original) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return sigprocmask_original(how, allow_lazy_faults(how, set, &allowed), oldset);
+}
+
+int pthread_sigmask(int how, const sigset_t *set, sigset_t *oldset) {
+    sigset_t allowed;
+
+    if (!pthread_sigmask_original)
+        resolve_signal_functions();
+    if (!pthread_sigmask_original)
+        return ENOSYS;
+    return pthread_sigmask_original(how, allow_lazy_faults(how, set, &allowed), oldset);
+}
+
 #endif
 
-/**
- * Parse the /proc/<pid>/maps file to find all executable memory segments
- *
- * @returns An array of text_region structs, which is terminated by an
- *  entry with .type = 0. The caller must free this array
-*/
-static text_region *explore_text_regions() {
-    const unsigned long vdso_base = getauxval(AT_SYSINFO_EHDR);
-    const static char mpath[] = "/proc/self/maps";
-    char perms[3] = {0,};
-    char *line = NULL;
-    unsigned i;
-    int status;
-    size_t start, end, last = 0, len = 0;
-    ssize_t count = 0;
-    FILE *maps;
-    text_region *regions;
+#endif
 
+// Parses a lowercase number, returns the position of the first character after it
+static const char *parse_number(const char *pos, const char *end, unsigned int base, uintptr_t *value) {
+    unsigned int digit;
 
-    maps = fopen(mpath, "r");
-    if (!maps)
-        return NULL;
+    for (*value = 0; pos < end; pos++) {
+        if (*pos >= '0' && *pos <= '9')
+            digit = *pos - '0';
+        else if (*pos >= 'a' && *pos <= 'f')
+            digit = *pos - 'a' + 10;
+        else
+            break;
+        if (digit >= base)
+            break;
+        *value = *value * base + digit;
+    }
+    return pos;
+}
 
-    // Get amount of executable memory regions
-    while (getline(&line, &len, maps) > 0) {
-        status = sscanf(line, "%lx-%lx %c%c%c", &start, &end, &perms[0], &perms[1], &perms[2]);
-        free(line);
-        line = NULL;
-        if (status != 5)
-            continue;
-        count += perms[2] == 'x' ? 1 : 0;
+/*
+ * Parses a line of /proc/self/maps, returns 1 if the mapping is executable code that can be
+ * migrated. The vsyscall page is in the kernel's half of the address space, which user space
+ * cannot remap.
+ */
+static int parse_maps_line(const char *line, const char *end, maps_entry *entry) {
+    line = parse_number(line, end, 16, &entry->start);
+    if (line == end || *line++ != '-' || (intptr_t) entry->start < 0)
+        return 0;
+    line = parse_number(line, end, 16, &entry->end);
+
+    // The permissions follow as " rwxp", then the offset, the device and the inode
+    if (end - line < 6 || line[0] != ' ' || line[3] != 'x')
+        return 0;
+    line = parse_number(line + 6, end, 16, &entry->offset);
+    line = parse_number(line + (line < end), end, 16, &entry->dev_major);
+    line = parse_number(line + (line < end), end, 16, &entry->dev_minor);
+    line = parse_number(line + (line < end), end, 10, &entry->inode);
+
+    while (line < end && *line == ' ')
+        line++;
+    entry->path = line < end ? line : NULL;
+    return 1;
+}
+
+/*
+ * Opens the file that a mapping of code was created from, so that migration can read the code
+ * from there instead of copying it out of the mapping first. This needs modxom, and the code must
+ * not be remapped from a backup, which is the case for libxom itself.
+ */
+static int open_mapped_file(const maps_entry *entry, unsigned char jump_into_backup) {
+    struct stat info;
+    int fd;
+
+    if (xomfd < 0 || jump_into_backup || !entry->path || entry->path[0] != '/' || !entry->inode)
+        return -1;
+
+    fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // The path may lead to a different file by now, e.g. after a package update
+    if (fstat(fd, &info) < 0 || info.st_ino != entry->inode || major(info.st_dev) != entry->dev_major ||
+        minor(info.st_dev) != entry->dev_minor) {
+        close(fd);
+        return -1;
     }
-    rewind(maps);
+    return fd;
+}
 
-    // We need this buffer until it was used once, which may be never
-    regions = malloc(sizeof(*regions) * (count + 1));
-    if (!regions) {
-        fclose(maps);
-        return NULL;
+/*
+ * Parses the comma-separated patterns of LIBXOM_LOCK=<mode>:<patterns>. A pattern that starts with
+ * '!' excludes the code that it matches from migration, any other pattern includes it.
+ */
+static int parse_migration_patterns(const char *list) {
+    char *patterns, *pattern, *saveptr = NULL;
+    size_t count = 1;
+    const char *c;
+
+    for (c = list; *c; c++)
+        count += *c == ',';
+
+    patterns = strdup(list);
+    migration_patterns = malloc(count * sizeof(*migration_patterns));
+    if (!patterns || !migration_patterns) {
+        free(patterns);
+        free(migration_patterns);
+        migration_patterns = NULL;
+        return -1;
     }
 
-    count = 0;
-    while (getline(&line, &len, maps) > 0) {
-        status = sscanf(line, "%lx-%lx %c%c%c", &start, &end, &perms[0], &perms[1], &perms[2]);
-        free(line);
-        line = NULL;
-        if (status != 5)
-            continue;
-        if (perms[2] != 'x')
+    for (pattern = strtok_r(patterns, ",", &saveptr); pattern; pattern = strtok_r(NULL, ",", &saveptr)) {
+        migration_patterns[num_migration_patterns++] = pattern;
+        has_include_patterns |= pattern[0] != '!';
+    }
+    return 0;
+}
+
+/*
+ * Decides whether the code mapped from path is migrated. Patterns are matched against the file
+ * name, or against the whole path if they contain a slash. Exclusions take precedence, and once
+ * there is a pattern that includes code, nothing else is included.
+ */
+static int is_migration_allowed(const char *path) {
+    const char *name, *pattern;
+    int allowed = !has_include_patterns;
+    size_t i;
+
+    if (!num_migration_patterns)
+        return 1;
+    if (!path || !*path)
+        return allowed;
+
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    for (i = 0; i < num_migration_patterns; i++) {
+        pattern = migration_patterns[i] + (migration_patterns[i][0] == '!');
+        if (fnmatch(pattern, strchr(pattern, '/') ? path : name, 0))
             continue;
+        if (pattern != migration_patterns[i])
+            return 0;
+        allowed = 1;
+    }
+    return allowed;
+}
 
-        regions[count].text_base = (char *) start;
-        regions[count].text_end = (char *) end;
+static int add_text_region(text_region **regions, size_t *count, size_t *capacity, const maps_entry *entry) {
+    const unsigned long vdso_base = getauxval(AT_SYSINFO_EHDR);
+    const unsigned char jump_into_backup = (entry->start <= (size_t) add_text_region &&
+                                            entry->end > (size_t) add_text_region) ? 1 : 0;
+    const unsigned char excluded = is_migration_allowed(entry->path) ? 0 : TEXT_TYPE_EXCLUDED;
+    text_region *grown;
+
+    // Keep room for the terminating entry
+    if (*count + 1 >= *capacity) {
+        grown = realloc(*regions, (*capacity * 2 + 32) * sizeof(**regions));
+        if (!grown)
+            return -1;
+        *regions = grown;
+        *capacity = *capacity * 2 + 32;
+    }
 
-        if (!count)
-            regions[count].type = TEXT_TYPE_EXECUTABLE;
-        else if (regions[count].text_base == (char *) vdso_base)
-            regions[count].type = TEXT_TYPE_VDSO;
-        else
-            regions[count].type = TEXT_TYPE_SHARED;
+    (*regions)[*count] = (text_region) {
+            .text_base = (char *) entry->start,
+            .text_end = (char *) entry->end,
+            .type = (!*count ? TEXT_TYPE_EXECUTABLE : entry->start == vdso_base ? TEXT_TYPE_VDSO : TEXT_TYPE_SHARED) |
+                    excluded,
+            .jump_into_backup = jump_into_backup,
+            .source_fd = excluded ? -1 : open_mapped_file(entry, jump_into_backup),
+            .file_offset = (off_t) entry->offset
+    };
+    (*count)++;
+    return 0;
+}
+
+// Closes the files that code was not read from after all
+static void free_text_regions(text_region *regions) {
+    unsigned int i;
 
-        regions[count].jump_into_backup = (start <= (size_t) explore_text_regions &&
-                                           end > (size_t) explore_text_regions) ? 1 : 0;
-        count++;
+    for (i = 0; regions[i].type; i++) {
+        if (regions[i].source_fd >= 0)
+            close(regions[i].source_fd);
     }
-    fclose(maps);
+    free(regions);
+}
 
-    regions[count].type = 0;
+/**
+ * Parse the /proc/<pid>/maps file to find all executable memory segments. The file is read once
+ * in chunks, and only the growing result array is allocated.
+ *
+ * @returns An array of text_region structs, which is terminated by an
+ *  entry with .type = 0. The caller must free it with free_text_regions
+*/
+static text_region *explore_text_regions() {
+    char buf[16384];
+    char *line, *newline;
+    size_t filled = 0, count = 0, capacity = 0;
+    maps_entry entry;
+    ssize_t status;
+    int fd, in_long_line = 0;
+    text_region *regions = NULL;
+
+    fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    while ((status = read(fd, buf + filled, sizeof(buf) - filled)) > 0) {
+        filled += status;
+
+        for (line = buf; (newline = memchr(line, '\n', buf + filled - line)); line = newline + 1) {
+            // Terminates the path for open
+            *newline = '\0';
+            if (!in_long_line && parse_maps_line(line, newline, &entry) &&
+                add_text_region(&regions, &count, &capacity, &entry) < 0)
+                goto fail;
+            in_long_line = 0;
+        }
+
+        filled = buf + filled - line;
+        memmove(buf, line, filled);
+
+        // Only the start of a line matters, so a line that does not fit is parsed now and its rest skipped
+        if (filled == sizeof(buf)) {
+            if (!in_long_line && parse_maps_line(buf, buf + filled, &entry)) {
+                entry.path = NULL;
+                if (add_text_region(&regions, &count, &capacity, &entry) < 0)
+                    goto fail;
+            }
+            in_long_line = 1;
+            filled = 0;
+        }
+    }
+    if (status < 0)
+        goto fail;
+    close(fd);
 
+    // An empty array is still terminated
+    if (!regions && !(regions = malloc(sizeof(*regions))))
+        return NULL;
+    regions[count].type = 0;
     return regions;
+
+fail:
+    close(fd);
+    if (regions) {
+        regions[count].type = 0;
+        free_text_regions(regions);
+    }
+    return NULL;
 }
 
 #if (defined(__x86_64__) || defined(_M_X64))
 
 /**
- * Unmap the code specified by space, remap it as xom, and fill it with the data in dest
+ * Unmap the code specified by space, remap it as xom, and fill it with the data in dest, or with
+ * the data at space->file_offset in space->source_fd if dest is NULL
  *
  * @param space A text_region describing the code section that should be remapped
  * @param dest A backup buffer containing the code in space. It must have the same size
@@ -280,10 +742,9 @@ static text_region *explore_text_regions() {
  * @returns 0 upon success, a negative value otherwise
 */
 static __attribute__((optimize("O0"))) int remap_no_libc(text_region *space, char *dest, int32_t fd) {
-    int status;
-    unsigned int i, c = 0;
-    char *remapping = space->text_base, *rptr;
-    ssize_t size_left = space->text_end - space->text_base;
+    ssize_t status;
+    size_t done, size = space->text_end - space->text_base;
+    char *rptr, *to = space->text_base;
 
     /*
     remap_no_libc must work in an environment where the GOT is unavailable,
@@ -296,57 +757,101 @@ static __attribute__((optimize("O0"))) int remap_no_libc(text_region *space, cha
 
     // Munmap old .text section
     asm volatile("syscall" : "=a"(status) : "a"(SYS_munmap),
-    "D"(space->text_base), "S"(space->text_end - space->text_base));
+    "D"(space->text_base), "S"(size) : "rcx", "r11", "memory");
 
     // If there is an error, we can do nothing but quit
     if (status < 0)
         asm volatile("syscall"::"a"(SYS_exit), "D"(1));  // exit(1)
 
-    // Mmap new .text section
-    while (size_left > 0) {
+    // Mmap new .text section as a single modxom mapping
+    asm volatile(
+            "mov %%ecx, %%ecx\n"
+            "mov %%rcx, %%r10\n"
+            "mov %%ebx, %%ebx\n"
+            "mov %%rbx, %%r8\n"
+            "mov $0, %%r9\n"
+            "syscall\n"
+            "mov %%rax, %0"
+            : "=r" (rptr)
+            : "a"(SYS_mmap), "D"(space->text_base), "S"(size),
+    "d"(PROT_NONE), "c"(MAP_SHARED), "b"(fd)
+            : "r8", "r9", "r10"
+            );
+
+    if (rptr != space->text_base)
+        asm volatile("syscall"::"a"(SYS_exit), "D"(-(int8_t) (uintptr_t) rptr)); // exit(errno)
+
+    if (dest) {
+        // Copy from backup into new .txt, rep movsb is as fast as a vectorized copy for large sizes
+        asm volatile("rep movsb" : "+D"(to), "+S"(dest), "+c"(size) : : "memory");
+        return 0;
+    }
+
+    // Read the code from its file. Pages past the end of the file stay zeroed
+    for (done = 0; done < size; done += status) {
         asm volatile(
-                "mov %%ecx, %%ecx\n"
-                "mov %%rcx, %%r10\n"
-                "mov %%ebx, %%ebx\n"
-                "mov %%rbx, %%r8\n"
-                "mov $0, %%r9\n"
-                "syscall\n"
-                "mov %%rax, %0"
-                : "=r" (rptr)
-                : "a"(SYS_mmap), "D"(remapping), "S"(min(size_left, ALLOC_CHUNK_SIZE)),
-        "d"(PROT_NONE), "c"(MAP_PRIVATE), "b"(fd)
-                : "r8", "r9", "r10"
+                "mov %5, %%r10\n"
+                "syscall"
+                : "=a"(status)
+                : "a"(SYS_pread64), "D"(space->source_fd), "S"(to + done), "d"(size - done),
+        "r"(space->file_offset + done)
+                : "rcx", "r10", "r11", "memory"
                 );
+        if (status < 0)
+            asm volatile("syscall"::"a"(SYS_exit), "D"(1));  // exit(1)
+        if (!status)
+            break;
+    }
 
-        if (rptr != space->text_base + c * ALLOC_CHUNK_SIZE)
-            asm volatile("syscall"::"a"(SYS_exit), "D"(-(int8_t) (uintptr_t) rptr)); // exit(errno)
+    return 0;
+}
 
-        remapping += ALLOC_CHUNK_SIZE;
-        size_left -= ALLOC_CHUNK_SIZE;
-        c++;
-    }
+/*
+ * Code can only be read back from its file if none of its pages was written to since it was
+ * mapped, e.g. for relocations or breakpoints. Such pages were copied into anonymous memory, which
+ * /proc/self/pagemap tells apart from pages of the file.
+ */
+static int matches_mapped_file(const text_region *space) {
+    uint64_t entries[512];
+    size_t page = (uintptr_t) space->text_base >> PAGE_SHIFT;
+    const size_t last_page = (uintptr_t) space->text_end >> PAGE_SHIFT;
+    size_t i, n;
+    int fd, ret = 1;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
 
-    // Copy from backup into new .txt
-    for (i = 0; i < (space->text_end - space->text_base) / sizeof(size_t); i++)
-        ((size_t *) space->text_base)[i] = ((size_t *) (dest))[i];
+    for (; ret && page < last_page; page += n) {
+        n = min(last_page - page, countof(entries));
+        if (pread(fd, entries, n * sizeof(*entries), (off_t) (page * sizeof(*entries))) !=
+            (ssize_t) (n * sizeof(*entries))) {
+            ret = 0;
+            break;
+        }
+        for (i = 0; i < n && ret; i++) {
+            if ((entries[i] & PAGEMAP_SWAPPED) || ((entries[i] & PAGEMAP_PRESENT) && !(entries[i] & PAGEMAP_FILE)))
+                ret = 0;
+        }
+    }
 
-    return 0;
+    close(fd);
+    return ret;
 }
 
 /**
  * Migrate the code in space to XOM
  *
  * @param space A text_region describing the code that should be migrated
+ * @param lock Receives the command that locks the code, which the caller must issue. Only set
+ *  with modxom
  * @returns 0 upon success, a negative value otherwise
 */
-static int migrate_text_section(text_region *space) {
+static int migrate_text_section(text_region *space, modxom_cmd *lock) {
     int status;
-    unsigned int c = 0;
-    char *dest;
+    char *dest = NULL;
     size_t num_pages = (space->text_end - space->text_base) >> PAGE_SHIFT;
-    ssize_t size_left;
     int (*remap_function)(text_region *, char *, int32_t);
-    modxom_cmd cmd;
 
     // If modxom is unavailable, use PKU
     if (xomfd < 0)
@@ -354,40 +859,247 @@ static int migrate_text_section(text_region *space) {
 
     // printf("Remapping %p - %p, type %u - %u\n", space->text_base, space->text_end, space->type, space->jump_into_backup);
 
-    // Mmap code backup
-    dest = mmap(NULL, num_pages << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (!~(uintptr_t) dest)
-        return -1;
-
-    // Copy code
-    memcpy(dest, space->text_base, num_pages << PAGE_SHIFT);
+    if (space->source_fd >= 0 && !matches_mapped_file(space)) {
+        close(space->source_fd);
+        space->source_fd = -1;
+    }
 
     remap_function = remap_no_libc;
 
-    // We cannot unmap the code we are currently executing. If this needs to be done, jump
-    // into the backup and do it from there
-    if (space->jump_into_backup) {
-        mprotect(dest, num_pages << PAGE_SHIFT, PROT_READ | PROT_EXEC);
-        remap_function = (int (*)(text_region *, char *, int32_t)) ((size_t) remap_function +
-                                                                    (ssize_t) (dest - space->text_base));
+    // Without a file to read the code from, it is copied into a backup first
+    if (space->source_fd < 0) {
+        dest = mmap(NULL, num_pages << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (!~(uintptr_t) dest)
+            return -1;
+
+        memcpy(dest, space->text_base, num_pages << PAGE_SHIFT);
+
+        // We cannot unmap the code we are currently executing. If this needs to be done, jump
+        // into the backup and do it from there
+        if (space->jump_into_backup) {
+            mprotect(dest, num_pages << PAGE_SHIFT, PROT_READ | PROT_EXEC);
+            remap_function = (int (*)(text_region *, char *, int32_t)) ((size_t) remap_function +
+                                                                        (ssize_t) (dest - space->text_base));
+        }
     }
 
     // Remap code into XOM buffer
     status = remap_function(space, dest, xomfd);
 
-    // Lock code
-    size_left = (space->text_end - space->text_base);
-    while (status >= 0 && size_left > 0) {
-        cmd.cmd = MODXOM_CMD_LOCK;
-        cmd.num_pages = min(size_left, ALLOC_CHUNK_SIZE) >> PAGE_SHIFT;
-        cmd.base_addr = (uintptr_t) space->text_base + c * ALLOC_CHUNK_SIZE;
-        status = write(xomfd, &cmd, sizeof(cmd));
-        size_left -= ALLOC_CHUNK_SIZE;
-        c++;
+    if (status >= 0) {
+        *lock = (modxom_cmd) {
+                .cmd = MODXOM_CMD_LOCK,
+                .num_pages = (uint32_t) num_pages,
+                .base_addr = (uint64_t) (uintptr_t) space->text_base
+        };
     }
 
-    // Unmap backup
-    munmap(dest, num_pages << PAGE_SHIFT);
+    if (dest)
+        munmap(dest, num_pages << PAGE_SHIFT);
+    if (space->source_fd >= 0) {
+        close(space->source_fd);
+        space->source_fd = -1;
+    }
+    return status;
+}
+
+// Makes room for count more migrated ranges, so that recording a successful migration cannot fail
+static int reserve_migrated(size_t count) {
+    migrated_range *grown;
+    size_t capacity = migrated_capacity;
+
+    while (capacity < num_migrated + count)
+        capacity = capacity * 2 + 16;
+    if (capacity == migrated_capacity)
+        return 0;
+
+    grown = realloc(migrated, capacity * sizeof(*migrated));
+    if (!grown)
+        return -1;
+    migrated = grown;
+    migrated_capacity = capacity;
+    return 0;
+}
+
+// Returns the migrated range that contains [start, end), or NULL
+static migrated_range *find_migrated(uintptr_t start, uintptr_t end) {
+    size_t low = 0, high = num_migrated, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (migrated[mid].start <= start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low && migrated[low - 1].end >= end ? &migrated[low - 1] : NULL;
+}
+
+static void record_migrated(const text_region *space) {
+    size_t i;
+
+    for (i = num_migrated; i && migrated[i - 1].start > (uintptr_t) space->text_base; i--);
+    memmove(&migrated[i + 1], &migrated[i], (num_migrated - i) * sizeof(*migrated));
+    migrated[i] = (migrated_range) {
+            .start = (uintptr_t) space->text_base,
+            .end = (uintptr_t) space->text_end,
+            .scan = migration_scan
+    };
+    num_migrated++;
+}
+
+/*
+ * Migrates all regions that are neither skipped nor migrated already, then locks all of them with
+ * a single vectored write to modxom. Regions count as migrated once they are remapped.
+ */
+static int migrate_text_regions(text_region *regions, size_t count, unsigned int skip_type) {
+    modxom_cmd *locks = NULL;
+    unsigned int num_locks = 0;
+    size_t i;
+    int status = 0;
+
+    if (reserve_migrated(count) < 0)
+        return -1;
+
+    // The first command is the vector's header
+    if (xomfd >= 0) {
+        locks = malloc((count + 1) * sizeof(*locks));
+        if (!locks)
+            return -1;
+    }
+
+    for (i = 0; i < count && status >= 0; i++) {
+        if (regions[i].type & skip_type ||
+            find_migrated((uintptr_t) regions[i].text_base, (uintptr_t) regions[i].text_end))
+            continue;
+        status = migrate_text_section(&regions[i], locks ? &locks[num_locks + 1] : NULL);
+        if (status < 0)
+            break;
+        record_migrated(&regions[i]);
+        num_locks += locks ? 1 : 0;
+    }
+
+    if (num_locks) {
+        locks[0] = (modxom_cmd) {.cmd = MODXOM_CMD_VECTOR, .num_pages = num_locks, .base_addr = 0};
+        if (write(xomfd, locks, (num_locks + 1) * sizeof(*locks)) < 0)
+            status = -1;
+    }
+
+    free(locks);
+    return status;
+}
+
+// Migrated code cannot be read by the kernel either, neither if it is in XOM nor if it is execute-only
+static int is_readable(uintptr_t address) {
+    char byte;
+    struct iovec local = {.iov_base = &byte, .iov_len = 1};
+    struct iovec remote = {.iov_base = (void *) address, .iov_len = 1};
+
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 1;
+}
+
+static int collect_new_code(struct dl_phdr_info *info, size_t __attribute__((unused)) size, void *data) {
+    code_scan *scan = data;
+    const ElfW(Phdr) *phdr;
+    migrated_range *known;
+    text_region *grown;
+    uintptr_t start, end;
+    unsigned char type;
+    ElfW(Half) i;
+
+    if (scan->first) {
+        if (info->dlpi_adds == loaded_adds && info->dlpi_subs == loaded_subs) {
+            scan->unchanged = 1;
+            return 1;
+        }
+        scan->adds = info->dlpi_adds;
+        scan->subs = info->dlpi_subs;
+    }
+    type = scan->first ? TEXT_TYPE_EXECUTABLE : TEXT_TYPE_SHARED;
+    // The main executable has no name in the list of loaded objects
+    if (!is_migration_allowed(scan->first ? (const char *) getauxval(AT_EXECFN) : info->dlpi_name))
+        type |= TEXT_TYPE_EXCLUDED;
+    scan->first = 0;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+            continue;
+
+        start = (info->dlpi_addr + phdr->p_vaddr) & ~((uintptr_t) PAGE_SIZE - 1);
+        end = SIZE_CEIL(info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz);
+        if ((start == scan->vdso_base ? TEXT_TYPE_VDSO : type) & scan->skip_type)
+            continue;
+
+        /*
+         * After an unload, a new object may have been loaded where migrated code used to be. Its
+         * code is still readable, and the range it replaced is dropped for not being found.
+         */
+        known = find_migrated(start, end);
+        if (known && (scan->subs == loaded_subs || !is_readable(start))) {
+            known->scan = migration_scan;
+            continue;
+        }
+
+        if (scan->count == scan->capacity) {
+            grown = realloc(scan->regions, (scan->capacity * 2 + 8) * sizeof(*scan->regions));
+            if (!grown)
+                return -1;
+            scan->regions = grown;
+            scan->capacity = scan->capacity * 2 + 8;
+        }
+        scan->regions[scan->count++] = (text_region) {
+                .text_base = (char *) start,
+                .text_end = (char *) end,
+                .type = type,
+                .jump_into_backup = (start <= (size_t) explore_text_regions &&
+                                     end > (size_t) explore_text_regions) ? 1 : 0,
+                .source_fd = -1
+        };
+    }
+    return 0;
+}
+
+/*
+ * Migrates the code of objects that were loaded since the last call, for the dlopen hooks. The
+ * loaded objects are walked with dl_iterate_phdr instead of rereading /proc/self/maps, the walk
+ * stops right away if nothing was loaded or unloaded, and code that is already in XOM is skipped.
+ */
+static int migrate_new_code(void) {
+    code_scan scan = {
+            .skip_type = migrate_dlopen | TEXT_TYPE_EXCLUDED,
+            .vdso_base = getauxval(AT_SYSINFO_EHDR),
+            .first = 1
+    };
+    size_t i, kept;
+    int status;
+
+    migration_scan++;
+    if (dl_iterate_phdr(collect_new_code, &scan) < 0) {
+        free(scan.regions);
+        return -1;
+    }
+    if (scan.unchanged)
+        return 0;
+
+    // Code of unloaded objects is gone, its address range may be reused by anything
+    if (scan.subs != loaded_subs) {
+        for (i = kept = 0; i < num_migrated; i++) {
+            if (migrated[i].scan == migration_scan)
+                migrated[kept++] = migrated[i];
+        }
+        num_migrated = kept;
+    }
+
+    status = migrate_text_regions(scan.regions, scan.count, 0);
+
+    // Otherwise, the next call walks the objects again and retries what was not migrated
+    if (status >= 0) {
+        loaded_adds = scan.adds;
+        loaded_subs = scan.subs;
+    }
+
+    free(scan.regions);
     return status;
 }
 
@@ -405,83 +1117,418 @@ static int migrate_skip_type(unsigned int skip_type) {
     if (!spaces)
         return -1;
 
-    while (spaces[i].type) {
-        if (!(spaces[i].type & skip_type)) {
-            status = migrate_text_section(&(spaces[i]));
-            if (status < 0)
-                break;
-        }
+    while (spaces[i].type)
         i++;
-    }
+    status = migrate_text_regions(spaces, i, skip_type);
 
-    free(spaces);
+    free_text_regions(spaces);
     spaces = NULL;
 
     return status;
 }
 
+// Returns the lazily migrated region that contains address, or NULL
+static lazy_region *find_lazy_region(uintptr_t address) {
+    size_t low = 0, high = num_lazy_regions, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if ((uintptr_t) lazy_regions[mid].text_base <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low && (uintptr_t) lazy_regions[low - 1].text_end > address ? &lazy_regions[low - 1] : NULL;
+}
+
+// Code that could not be migrated must not run as if it was in XOM, so give up like remap_no_libc does
+static void __attribute__((noreturn)) lazy_migration_failed(void) {
+    static const char message[] = "libxom: Failed to migrate lazily migrated code into XOM\n";
+    ssize_t __attribute__((unused)) written = write(STDERR_FILENO, message, sizeof(message) - 1);
+
+    _exit(1);
+}
+
+// Migrates the chunk of region that contains address, unless another thread did so already
+static void migrate_lazy_chunk(lazy_region *region, uintptr_t address) {
+    const size_t chunk = (address - (uintptr_t) region->text_base) / LAZY_CHUNK_SIZE;
+    text_region space = {
+            .text_base = region->text_base + chunk * LAZY_CHUNK_SIZE,
+            .text_end = min(region->text_base + (chunk + 1) * LAZY_CHUNK_SIZE, region->text_end),
+            .type = TEXT_TYPE_LAZY,
+            .source_fd = -1
+    };
+    const size_t size = space.text_end - space.text_base;
+    sigset_t old_mask;
+    int status;
+
+    lock_lazy(&old_mask);
+
+    if (!test_page_bit(region->migrated_chunks, chunk)) {
+        if (xomfd < 0) {
+            status = mprotect(space.text_base, size, PROT_EXEC);
+        } else {
+            status = mprotect(space.text_base, size, PROT_READ);
+            if (status >= 0) {
+                memcpy(lazy_backup, space.text_base, size);
+                remap_no_libc(&space, lazy_backup, xomfd);
+                status = xom_cmd_region(space.text_base, size, MODXOM_CMD_LOCK);
+            }
+        }
+        if (status < 0)
+            lazy_migration_failed();
+        set_page_bit(region->migrated_chunks, chunk);
+    }
+
+    unlock_lazy(&old_mask);
+}
+
+/*
+ * Migrates lazily migrated code when it is first executed. Any other fault, including reads of
+ * code, goes to the handler that was installed before. A default action is taken by restoring it
+ * and letting the access fault again. SA_RESETHAND of that handler is emulated here, as the fault
+ * handler itself must stay installed.
+ */
+static void lazy_migration_handler(int signum, siginfo_t *info, void *context) {
+    const ucontext_t *ucontext = context;
+    const int saved_errno = errno;
+    lazy_region *region = find_lazy_region((uintptr_t) info->si_addr);
+    struct sigaction action;
+    sigset_t old_mask;
+
+    if (region && (ucontext->uc_mcontext.gregs[REG_ERR] & PF_INSTRUCTION_FETCH)) {
+        migrate_lazy_chunk(region, (uintptr_t) info->si_addr);
+        errno = saved_errno;
+        return;
+    }
+
+    lock_lazy(&old_mask);
+    action = lazy_old_action;
+    if (action.sa_flags & SA_RESETHAND) {
+        lazy_old_action = (struct sigaction) {.sa_handler = SIG_DFL};
+        set_lazy_handler();
+    }
+    unlock_lazy(&old_mask);
+
+    if (action.sa_flags & SA_SIGINFO)
+        action.sa_sigaction(signum, info, context);
+    else if (action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN)
+        action.sa_handler(signum);
+    else
+        sigaction_original(SIGSEGV, &action, NULL);
+    errno = saved_errno;
+}
+
+/*
+ * Installs the fault handler with the mask of the application's handler and the flags that affect
+ * how it is delivered. It always runs on the alternate stack if there is one, so that the handler
+ * of a stack overflow still gets to run. Called with lazy_lock held once the handler is installed.
+ */
+static int set_lazy_handler(void) {
+    struct sigaction action = {
+            .sa_sigaction = lazy_migration_handler,
+            .sa_mask = lazy_old_action.sa_mask,
+            .sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK | (lazy_old_action.sa_flags & SA_NODEFER)
+    };
+
+    return sigaction_original(SIGSEGV, &action, NULL);
+}
+
+// Lazily migrated code must not include the code that handles its faults, i.e. libxom, libc and the loader
+static int needed_by_fault_handler(const text_region *space) {
+    Dl_info region_info, libc_info;
+
+    if (space->jump_into_backup)
+        return 1;
+    if (!dladdr(space->text_base, &region_info) || !dladdr((void *) mprotect, &libc_info))
+        return 1;
+    return region_info.dli_fbase == libc_info.dli_fbase ||
+           (uintptr_t) region_info.dli_fbase == getauxval(AT_BASE);
+}
+
+/*
+ * Sets up LIBXOM_LOCK=lazy. Code is made inaccessible instead of being migrated, and the fault
+ * handler migrates it chunk by chunk when it is executed, so that startup does not wait for code
+ * that never runs and XOM only holds the code that does. The code of the fault handler itself is
+ * migrated right away, code loaded by dlopen later is migrated as it is loaded.
+ * A fault with SIGSEGV blocked kills the process, so the interposers keep threads and the handlers of
+ * other signals from blocking it. The application's own SIGSEGV handler runs with SIGSEGV blocked
+ * unless it asks for SA_NODEFER, so its code must be excluded with a pattern, e.g. lazy:!myprogram.
+ */
+static int migrate_lazily_internal(void) {
+    text_region *spaces;
+    size_t i, n, chunks;
+    int status;
+
+#ifndef LIBXOM_SHARED
+    // Without the signal interposers of the shared library, the application could remove the fault handler
+    return migrate_all_code_internal();
+#endif
+
+    if (!xom_mode) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    spaces = explore_text_regions();
+    if (!spaces)
+        return -1;
+
+    for (n = 0; spaces[n].type; n++) {
+        if (spaces[n].type & (TEXT_TYPE_EXECUTABLE | TEXT_TYPE_SHARED) && !(spaces[n].type & TEXT_TYPE_EXCLUDED) &&
+            !needed_by_fault_handler(&spaces[n]))
+            spaces[n].type |= TEXT_TYPE_LAZY;
+    }
+
+    lazy_regions = calloc(n, sizeof(*lazy_regions));
+    if (xomfd >= 0)
+        lazy_backup = mmap(NULL, LAZY_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (!lazy_regions || lazy_backup == MAP_FAILED) {
+        status = -1;
+        goto exit;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!(spaces[i].type & TEXT_TYPE_LAZY))
+            continue;
+        chunks = ((spaces[i].text_end - spaces[i].text_base) + LAZY_CHUNK_SIZE - 1) / LAZY_CHUNK_SIZE;
+        lazy_regions[num_lazy_regions] = (lazy_region) {
+                .text_base = spaces[i].text_base,
+                .text_end = spaces[i].text_end,
+                .migrated_chunks = calloc(BITMAP_WORDS(chunks), sizeof(uint64_t))
+        };
+        if (!lazy_regions[num_lazy_regions].migrated_chunks) {
+            status = -1;
+            goto exit;
+        }
+        num_lazy_regions++;
+    }
+
+    // Everything the fault handler needs is migrated right away, and the signals it handles must not be blocked
+    status = migrate_text_regions(spaces, n, TEXT_TYPE_VDSO | TEXT_TYPE_LAZY | TEXT_TYPE_EXCLUDED);
+    unblock_signal(SIGSEGV);
+    if (status < 0 || sigaction(SIGSEGV, NULL, &lazy_old_action) < 0 || set_lazy_handler() < 0) {
+        status = -1;
+        goto exit;
+    }
+    lazy_handler_installed = 1;
+
+    // Lazy code counts as migrated already, so that neither dlopen nor explicit migration touches it
+    for (i = 0; i < n; i++) {
+        if (!(spaces[i].type & TEXT_TYPE_LAZY))
+            continue;
+        record_migrated(&spaces[i]);
+        mprotect(spaces[i].text_base, spaces[i].text_end - spaces[i].text_base, PROT_NONE);
+    }
+
+exit:
+    free_text_regions(spaces);
+    return status;
+}
+
 static inline int migrate_shared_libraries_internal() {
-    return migrate_skip_type(TEXT_TYPE_EXECUTABLE | TEXT_TYPE_VDSO);
+    return migrate_skip_type(TEXT_TYPE_EXECUTABLE | TEXT_TYPE_VDSO | TEXT_TYPE_EXCLUDED);
 }
 
 static inline int migrate_all_code_internal() {
-    return migrate_skip_type(TEXT_TYPE_VDSO);
+    return migrate_skip_type(TEXT_TYPE_VDSO | TEXT_TYPE_EXCLUDED);
 }
 
 #endif
 
+static void *alloc_header(void) {
+    union xom_header *slab, *ret;
+    unsigned int i;
+
+    pthread_mutex_lock(&va_lock);
+    if (!free_headers) {
+        slab = malloc(HEADERS_PER_SLAB * sizeof(*slab));
+        for (i = 0; slab && i < HEADERS_PER_SLAB; i++) {
+            slab[i].next_free = free_headers;
+            free_headers = &slab[i];
+        }
+    }
+    ret = free_headers;
+    if (ret)
+        free_headers = ret->next_free;
+    pthread_mutex_unlock(&va_lock);
+
+    if (!ret)
+        errno = ENOMEM;
+    return ret;
+}
+
+static void free_header(void *header) {
+    union xom_header *h = header;
+
+    pthread_mutex_lock(&va_lock);
+    h->next_free = free_headers;
+    free_headers = h;
+    pthread_mutex_unlock(&va_lock);
+}
+
+/*
+ * Takes size bytes of XOM address space with the given alignment. Freed ranges are reused first
+ * fit, so that processes which keep allocating and freeing buffers stay within a compact region.
+ * Only when none fits, the range is taken from the end of the XOM address space.
+ */
+static void *va_reserve(size_t size, size_t align) {
+    uintptr_t start, end;
+    size_t i;
+    void *ret = NULL;
+
+    pthread_mutex_lock(&va_lock);
+    for (i = 0; i < va_num_free; i++) {
+        start = (va_free_ranges[i].start + align - 1) & ~(align - 1);
+        end = va_free_ranges[i].start + va_free_ranges[i].size;
+        if (start + size > end)
+            continue;
+
+        if (start == va_free_ranges[i].start && start + size == end) {
+            memmove(&va_free_ranges[i], &va_free_ranges[i + 1], (va_num_free - i - 1) * sizeof(*va_free_ranges));
+            va_num_free--;
+        } else if (start == va_free_ranges[i].start) {
+            va_free_ranges[i] = (va_range) {.start = start + size, .size = end - start - size};
+        } else if (start + size == end || va_num_free < va_free_capacity) {
+            // The part below the aligned start stays free, as well as the part above the range if any
+            va_free_ranges[i].size = start - va_free_ranges[i].start;
+            if (start + size < end) {
+                memmove(&va_free_ranges[i + 2], &va_free_ranges[i + 1],
+                        (va_num_free - i - 1) * sizeof(*va_free_ranges));
+                va_free_ranges[i + 1] = (va_range) {.start = start + size, .size = end - start - size};
+                va_num_free++;
+            }
+        } else
+            continue;
+        ret = (void *) start;
+        break;
+    }
+
+    if (!ret) {
+        ret = (void *) (((uintptr_t) xom_base_addr + align - 1) & ~(align - 1));
+        xom_base_addr = (char *) ret + size;
+    }
+    pthread_mutex_unlock(&va_lock);
+    return ret;
+}
+
+// Returns a range to the free list and merges it with its neighbours
+static void va_release(void *address, size_t size) {
+    const uintptr_t start = (uintptr_t) address;
+    va_range *new_ranges;
+    size_t i;
+
+    pthread_mutex_lock(&va_lock);
+    for (i = 0; i < va_num_free && va_free_ranges[i].start < start; i++);
+
+    if (i && va_free_ranges[i - 1].start + va_free_ranges[i - 1].size == start) {
+        va_free_ranges[i - 1].size += size;
+        if (i < va_num_free && start + size == va_free_ranges[i].start) {
+            va_free_ranges[i - 1].size += va_free_ranges[i].size;
+            memmove(&va_free_ranges[i], &va_free_ranges[i + 1], (va_num_free - i - 1) * sizeof(*va_free_ranges));
+            va_num_free--;
+        }
+    } else if (i < va_num_free && start + size == va_free_ranges[i].start) {
+        va_free_ranges[i].start = start;
+        va_free_ranges[i].size += size;
+    } else {
+        if (va_num_free == va_free_capacity) {
+            new_ranges = realloc(va_free_ranges, (va_free_capacity * 2 + 16) * sizeof(*va_free_ranges));
+            // Without memory for the list, the range is simply never reused
+            if (!new_ranges)
+                goto exit;
+            va_free_ranges = new_ranges;
+            va_free_capacity = va_free_capacity * 2 + 16;
+        }
+        memmove(&va_free_ranges[i + 1], &va_free_ranges[i], (va_num_free - i) * sizeof(*va_free_ranges));
+        va_free_ranges[i] = (va_range) {.start = start, .size = size};
+        va_num_free++;
+    }
+
+    // A free range at the end of the XOM address space is given back to it
+    if (va_num_free && va_free_ranges[va_num_free - 1].start + va_free_ranges[va_num_free - 1].size ==
+                       (uintptr_t) xom_base_addr) {
+        xom_base_addr = (void *) va_free_ranges[va_num_free - 1].start;
+        va_num_free--;
+    }
+
+exit:
+    pthread_mutex_unlock(&va_lock);
+}
+
+/*
+ * Maps a new XOM range of *size bytes. Large ranges are placed at 2MB-aligned addresses and
+ * rounded up to whole 2MB units, so that modxom can back them with 2MB blocks that are sealed as
+ * whole superpages. *va_owned is set if the range belongs to the XOM address space allocator.
+ */
+static void *map_xom_range(size_t *size, uint8_t *va_owned) {
+    void *hint, *address;
+
+    if (*size >= XOM_SUPERPAGE_SIZE)
+        *size = SUPERPAGE_CEIL(*size);
+
+    hint = va_reserve(SIZE_CEIL(*size), *size >= XOM_SUPERPAGE_SIZE ? XOM_SUPERPAGE_SIZE : PAGE_SIZE);
+    // modxom only accepts shared mappings, which children inherit without copy-on-write
+    address = mmap(hint, SIZE_CEIL(*size), PROT_READ | PROT_WRITE,
+                   xomfd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, xomfd, 0);
+    // The kernel only treats the address as a hint, something else may already be mapped there
+    *va_owned = address == hint;
+    if (!*va_owned)
+        va_release(hint, SIZE_CEIL(*size));
+    if (address == MAP_FAILED)
+        return MAP_FAILED;
+
+    // Without modxom, let the kernel back large buffers with transparent huge pages instead
+    if (xomfd < 0 && *size >= XOM_SUPERPAGE_SIZE)
+        madvise(address, SIZE_CEIL(*size), MADV_HUGEPAGE);
+    return address;
+}
+
+static void unmap_xom_range(void *address, size_t size, uint8_t mode, uint8_t va_owned) {
+    /*
+     * modxom unmaps the buffer when freeing it, the munmap only catches a failure to do so. A
+     * child's own modxom file does not know inherited buffers, so it merely drops its mapping.
+     */
+    if (mode == XOM_MODE_SLAT)
+        xom_cmd_region(address, size, MODXOM_CMD_FREE);
+    munmap(address, SIZE_CEIL(size));
+    if (va_owned)
+        va_release(address, SIZE_CEIL(size));
+}
+
 static p_xombuf xomalloc_page_internal(size_t size) {
-    void *current_address = xom_base_addr, *last_address = NULL;
-    ssize_t size_left = (ssize_t) size;
+    const unsigned int mode = xom_mode;
+    uint8_t va_owned;
+    void *address;
     p_xombuf ret;
 
-    if (!size || !xom_mode) {
+    if (!size || !mode) {
         errno = EINVAL;
         return NULL;
     }
 
-    ret = malloc(sizeof(*ret));
-
-    if (!ret) {
-        errno = ENOMEM;
+    ret = alloc_header();
+    if (!ret)
         return NULL;
-    }
 
-    ret->address = NULL;
-    while (size_left > 0) {
-        current_address = mmap(current_address, SIZE_CEIL(min(ALLOC_CHUNK_SIZE, size_left)),
-                               PROT_READ | PROT_WRITE, MAP_PRIVATE | (xomfd < 0 ? MAP_ANONYMOUS : 0), xomfd, 0);
-        if (!current_address)
-            goto fail;
-        if (!ret->address)
-            ret->address = current_address;
-        last_address = current_address;
-        current_address += ALLOC_CHUNK_SIZE;
-        xom_base_addr = current_address;
-        size_left -= ALLOC_CHUNK_SIZE;
+    address = map_xom_range(&size, &va_owned);
+    if (address == MAP_FAILED) {
+        free_header(ret);
+        return NULL;
     }
 
-
     *ret = (_xombuf) {
-            .address = ret->address,
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .address = address,
             .allocated_size = size,
-            .pid = getpid(),
+            .pid = libxom_pid,
             .locked = 0,
-            .marked = 0,
-            .xom_mode = (uint8_t) xom_mode
+            .marked_pages = NULL,
+            .xom_mode = (uint8_t) mode,
+            .va_owned = va_owned
     };
 
     return ret;
-
-    fail:
-    size_left = (ssize_t) size;
-    while (ret->address && ret->address <= last_address) {
-        munmap(ret->address, SIZE_CEIL(min(ALLOC_CHUNK_SIZE, size_left)));
-        ret->address += ALLOC_CHUNK_SIZE;
-        size_left -= ALLOC_CHUNK_SIZE;
-    }
-    free(ret);
-    return NULL;
 }
 
 static int
@@ -499,10 +1546,6 @@ xom_write_internal(struct xombuf *dest, const void *const restrict src, const si
 }
 
 static void *xom_lock_internal(struct xombuf *buf) {
-    int status, c = 0;
-    modxom_cmd cmd;
-    ssize_t size_left;
-
     if (!buf) {
         errno = EINVAL;
         return NULL;
@@ -521,230 +1564,348 @@ static void *xom_lock_internal(struct xombuf *buf) {
     if (buf->pid != libxom_pid)
         return NULL;
 
-    size_left = (ssize_t) buf->allocated_size;
-    while (size_left > 0) {
-        cmd = (modxom_cmd) {
-                .cmd = MODXOM_CMD_LOCK,
-                .num_pages = (uint32_t) SIZE_CEIL(min(size_left, ALLOC_CHUNK_SIZE)) >> PAGE_SHIFT,
-                .base_addr = (uint64_t) (uintptr_t) buf->address + c * ALLOC_CHUNK_SIZE
-        };
-        status = (int) write(xomfd, &cmd, sizeof(cmd));
-        if (status < 0)
-            return NULL;
-        size_left -= ALLOC_CHUNK_SIZE;
-        c++;
-    }
+    if (xom_cmd_region(buf->address, buf->allocated_size, MODXOM_CMD_LOCK) < 0)
+        return NULL;
     buf->locked = 1;
     return buf->address;
 }
 
 static void xom_free_internal(struct xombuf *buf) {
-    unsigned int c = 0;
-    modxom_cmd cmd;
-    ssize_t size_left;
-
     if (!buf)
         return;
 
-    if (buf->xom_mode == XOM_MODE_PKU) {
-        munmap(buf->address, SIZE_CEIL(buf->allocated_size));
-        free(buf);
-        return;
-    }
-
-    size_left = buf->allocated_size;
-    while (size_left > 0) {
-        cmd = (modxom_cmd) {
-                .cmd = MODXOM_CMD_FREE,
-                .num_pages = SIZE_CEIL(min(size_left, ALLOC_CHUNK_SIZE)) >> PAGE_SHIFT,
-                .base_addr = (uint64_t) (uintptr_t) buf->address + c * ALLOC_CHUNK_SIZE
-        };
-        write(xomfd, &cmd, sizeof(cmd));
-        munmap(buf->address, SIZE_CEIL(min(size_left, ALLOC_CHUNK_SIZE)));
-        size_left -= ALLOC_CHUNK_SIZE;
-        c++;
-    }
-    free(buf);
+    pthread_mutex_destroy(&buf->lock);
+    unmap_xom_range(buf->address, buf->allocated_size, buf->xom_mode, buf->va_owned);
+    free(buf->marked_pages);
+    free_header(buf);
 }
 
 static struct xom_subpages *xom_alloc_subpages_internal(size_t size) {
-    int status;
+    const unsigned int mode = xom_mode;
     modxom_cmd cmd;
-    p_xom_subpages ret = NULL;
-    p_xombuf xombuf;
+    p_xom_subpages ret;
+    size_t mapped_size = size;
+    uint8_t va_owned;
+    void *address;
 
-    if (size > ALLOC_CHUNK_SIZE)
+    if (!size || !mode) {
+        errno = EINVAL;
         return NULL;
+    }
 
-    xombuf = xomalloc_page_internal(size);
-
-    if (!xombuf)
+    ret = alloc_header();
+    if (!ret)
         return NULL;
 
-    ret = calloc(1, sizeof(*ret));
-    if (!ret) {
-        errno = ENOMEM;
-        goto exit;
+    address = map_xom_range(&mapped_size, &va_owned);
+    if (address == MAP_FAILED) {
+        free_header(ret);
+        return NULL;
     }
 
     *ret = (_xom_subpages) {
-            .xom_mode = xom_mode,
-            .address = xombuf->address,
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .xom_mode = (uint8_t) mode,
+            .va_owned = va_owned,
+            .address = address,
+            .mapped_size = mapped_size,
             .lock_status = calloc((SIZE_CEIL(size) >> PAGE_SHIFT), sizeof(uint32_t)),
+            .allocation_ends = calloc((SIZE_CEIL(size) >> PAGE_SHIFT), sizeof(uint32_t)),
             .references = 0,
             .num_subpages = (size / SUBPAGE_SIZE) + (size % SUBPAGE_SIZE ? 1 : 0)
     };
+    ret->num_pages = (unsigned int) ((ret->num_subpages * SUBPAGE_SIZE) / PAGE_SIZE);
+    ret->free_subpages = ret->num_pages * SUBPAGES_PER_PAGE;
+    ret->first_free_page = 0;
 
-    if (!ret->lock_status) {
-        free(ret);
-        ret = NULL;
+    if (!ret->lock_status || !ret->allocation_ends) {
         errno = ENOMEM;
+        goto fail;
     }
 
-    if (xom_mode == XOM_MODE_SLAT) {
+    if (mode == XOM_MODE_SLAT) {
         cmd.cmd = MODXOM_CMD_INIT_SUBPAGES;
-        cmd.base_addr = (uint64_t) (uintptr_t) xombuf->address;
-        cmd.num_pages = SIZE_CEIL(xombuf->allocated_size) >> PAGE_SHIFT;
-        status = (int) write(xomfd, &cmd, sizeof(cmd));
-        if (status < 0 && ret) {
-            free(ret->lock_status);
-            free(ret);
-            goto exit;
-        }
-    } else if (xom_mode == XOM_MODE_PKU) {
+        cmd.base_addr = (uint64_t) (uintptr_t) address;
+        cmd.num_pages = SIZE_CEIL(mapped_size) >> PAGE_SHIFT;
+        if (write(xomfd, &cmd, sizeof(cmd)) < 0)
+            goto fail;
+    } else if (mode == XOM_MODE_PKU) {
+        __libxom_prologue();
         if (subpage_pkey < 0)
             subpage_pkey = pkey_alloc(0, PKEY_DISABLE_ACCESS);
-        pkey_mprotect(ret->address, xombuf->allocated_size, PROT_READ | PROT_WRITE | PROT_EXEC, subpage_pkey);
+        __libxom_epilogue();
+        pkey_mprotect(address, mapped_size, PROT_READ | PROT_WRITE | PROT_EXEC, subpage_pkey);
     }
 
-    exit:
-    free(xombuf);
     return ret;
+
+fail:
+    unmap_xom_range(address, mapped_size, (uint8_t) mode, va_owned);
+    free(ret->lock_status);
+    free(ret->allocation_ends);
+    free_header(ret);
+    return NULL;
 }
 
-static void *write_into_subpages(struct xom_subpages *dest, size_t subpages_required, const void *restrict src,
-                                 unsigned int base_page, unsigned int base_subpage, uint32_t mask) {
-    int status;
-    unsigned int i;
+// Transform the subpages' XOM into WO, returns the previous PKRU value for restore_pkru
+static inline unsigned int allow_subpage_writes(void) {
     unsigned int pkru;
-    xom_subpage_write *write_cmd;
 
-    if (dest->xom_mode == XOM_MODE_SLAT) {
-        write_cmd = malloc(sizeof(*write_cmd));
+    asm volatile (
+            "rdpkru"
+            : "=a" (pkru)
+            : "c" (0), "d" (0)
+            );
+    asm volatile(
+            "wrpkru"
+            ::"a" (pkru & ~(0x3 << (subpage_pkey << 1))), "c" (0), "d"(0)
+            );
+    return pkru;
+}
 
-        write_cmd->mxom_cmd = (modxom_cmd) {
-                .cmd = MODXOM_CMD_WRITE_SUBPAGES,
-                .num_pages = 1,
-                .base_addr = (uint64_t) (uintptr_t) (dest->address + base_page * PAGE_SIZE),
-        };
+static inline void restore_pkru(unsigned int pkru) {
+    asm volatile (
+            "wrpkru\n"
+            ::"a" (pkru), "c" (0), "d" (0)
+            );
+}
+
+// Leaves a bit set at every subpage of a page where a run of len free subpages starts
+static inline uint32_t free_run_starts(uint32_t lock_status, unsigned int len) {
+    uint64_t runs = (uint32_t) ~lock_status;
+    unsigned int have = 1, step;
+
+    // Subpages past the end of the page count as locked, so runs never leave the page
+    while (have < len) {
+        step = min(have, len - have);
+        runs &= runs >> step;
+        have += step;
+    }
+    return (uint32_t) runs;
+}
 
-        write_cmd->xen_cmd.num_subpages = subpages_required;
+/*
+ * Finds the first run of len free subpages, starting at the first page with room. Runs of up to
+ * a page stay within one page, longer ones start in the free upper part of a page, continue over
+ * entirely free pages and end in the free lower part of a page.
+ * Returns the index of the run's first subpage within the array, or -1 if there is none.
+ */
+static ssize_t find_free_subpages(const struct xom_subpages *subpages, size_t len) {
+    unsigned int page, lead, tail;
+    size_t run_start = 0, run_len = 0;
+    uint32_t lock_status, starts;
+
+    if (!len || len > subpages->free_subpages)
+        return -1;
 
-        for (i = 0; i < subpages_required; i++) {
-            write_cmd->xen_cmd.write_info[i].target_subpage = i + base_subpage;
-            memcpy(write_cmd->xen_cmd.write_info[i].data, (char *) src + (i * SUBPAGE_SIZE), SUBPAGE_SIZE);
+    for (page = subpages->first_free_page; page < subpages->num_pages; page++) {
+        lock_status = subpages->lock_status[page];
+        if (lock_status == UINT32_MAX) {
+            run_len = 0;
+            continue;
         }
 
-        status = write(xomfd, write_cmd,
-                       sizeof(write_cmd->mxom_cmd) + sizeof(write_cmd->xen_cmd.num_subpages) +
-                       subpages_required * sizeof(*write_cmd->xen_cmd.write_info));
+        if (len <= SUBPAGES_PER_PAGE) {
+            starts = free_run_starts(lock_status, (unsigned int) len);
+            if (starts)
+                return (ssize_t) (page * SUBPAGES_PER_PAGE + __builtin_ctz(starts));
+            continue;
+        }
+
+        // Extend a run that reaches the end of the previous page
+        lead = lock_status ? __builtin_ctz(lock_status) : SUBPAGES_PER_PAGE;
+        if (run_len && run_len + lead >= len)
+            return (ssize_t) run_start;
+        if (run_len && !lock_status) {
+            run_len += SUBPAGES_PER_PAGE;
+            continue;
+        }
 
-        free(write_cmd);
+        tail = lock_status ? __builtin_clz(lock_status) : SUBPAGES_PER_PAGE;
+        run_start = (page + 1) * SUBPAGES_PER_PAGE - tail;
+        run_len = tail;
+    }
 
-        if (status < 0)
+    return -1;
+}
+
+/*
+ * Writes n subpages from src into the array, starting at its subpage first, and locks them. With
+ * SLAT, all of them are written with one MODXOM_CMD_WRITE_SUBPAGES_MULTI command, which carries
+ * up to MAX_SUBPAGES_PER_RUN subpages of one page per run.
+ */
+static void *write_into_subpages(struct xom_subpages *dest, size_t first, size_t n, const void *restrict src) {
+    int status;
+    unsigned int page, subpage, count;
+    size_t i, done, num_runs = 0, cmd_size;
+    unsigned int pkru;
+    char *cmd_buf, *pos;
+    xom_subpage_write_run *run;
+    xom_subpage_write_info *info;
+    char *const address = (char *) dest->address + first * SUBPAGE_SIZE;
+
+    if (dest->xom_mode == XOM_MODE_SLAT) {
+        for (done = 0; done < n; done += count, num_runs++) {
+            subpage = (first + done) % SUBPAGES_PER_PAGE;
+            count = (unsigned int) min(min(n - done, SUBPAGES_PER_PAGE - subpage), MAX_SUBPAGES_PER_RUN);
+        }
+        cmd_size = sizeof(modxom_cmd) + num_runs * sizeof(*run) + n * sizeof(*info);
+        cmd_buf = malloc(cmd_size);
+        if (!cmd_buf)
             return NULL;
-    } else if (dest->xom_mode == XOM_MODE_PKU) {
-        // Transform XOM into WO for filling the subpage, then turn back into XOM
-        asm volatile (
-                "rdpkru"
-                : "=a" (pkru)
-                : "c" (0), "d" (0)
-                );
-        asm volatile(
-                "wrpkru"
-                ::"a" (pkru & ~(0x3 << (subpage_pkey << 1))), "c" (0), "d"(0)
-                );
 
-        memcpy(
-                (char *) dest->address + base_page * PAGE_SIZE + base_subpage * SUBPAGE_SIZE,
-                src,
-                subpages_required * SUBPAGE_SIZE
-        );
+        *(modxom_cmd *) cmd_buf = (modxom_cmd) {
+                .cmd = MODXOM_CMD_WRITE_SUBPAGES_MULTI,
+                .num_pages = (uint32_t) num_runs,
+                .base_addr = 0,
+        };
+        pos = cmd_buf + sizeof(modxom_cmd);
+        for (done = 0; done < n; done += count) {
+            page = (unsigned int) ((first + done) / SUBPAGES_PER_PAGE);
+            subpage = (first + done) % SUBPAGES_PER_PAGE;
+            count = (unsigned int) min(min(n - done, SUBPAGES_PER_PAGE - subpage), MAX_SUBPAGES_PER_RUN);
+
+            run = (xom_subpage_write_run *) pos;
+            *run = (xom_subpage_write_run) {
+                    .dest_addr = (uint64_t) (uintptr_t) ((char *) dest->address + page * PAGE_SIZE),
+                    .num_subpages = (uint8_t) count,
+            };
+            info = (xom_subpage_write_info *) (run + 1);
+            for (i = 0; i < count; i++) {
+                info[i].target_subpage = (uint8_t) (subpage + i);
+                memcpy(info[i].data, (const char *) src + (done + i) * SUBPAGE_SIZE, SUBPAGE_SIZE);
+            }
+            pos = (char *) (info + count);
+        }
+
+        status = (int) write(xomfd, cmd_buf, cmd_size);
+        free(cmd_buf);
 
-        asm volatile (
-                "wrpkru\n"
-                ::"a" (pkru), "c" (0), "d" (0)
-                );
+        if (status < 0)
+            return NULL;
+    } else if (dest->xom_mode == XOM_MODE_PKU) {
+        // Transform XOM into WO for filling the subpages, then turn back into XOM
+        pkru = allow_subpage_writes();
+        memcpy(address, src, n * SUBPAGE_SIZE);
+        restore_pkru(pkru);
     } else
         return NULL;
 
-
-    dest->lock_status[base_page] |= mask << base_subpage;
+    for (done = 0; done < n; done += count) {
+        page = (unsigned int) ((first + done) / SUBPAGES_PER_PAGE);
+        subpage = (first + done) % SUBPAGES_PER_PAGE;
+        count = (unsigned int) min(n - done, SUBPAGES_PER_PAGE - subpage);
+        dest->lock_status[page] |= (uint32_t) (((1ull << count) - 1) << subpage);
+    }
+    dest->allocation_ends[(first + n - 1) / SUBPAGES_PER_PAGE] |= 1u << ((first + n - 1) % SUBPAGES_PER_PAGE);
+    dest->free_subpages -= n;
+    while (dest->first_free_page < dest->num_pages && dest->lock_status[dest->first_free_page] == UINT32_MAX)
+        dest->first_free_page++;
     dest->references++;
-    return dest->address + base_page * PAGE_SIZE + base_subpage * SUBPAGE_SIZE;
+    return address;
 }
 
 static void *xom_fill_and_lock_subpages_internal(struct xom_subpages *dest, size_t size, const void *restrict src) {
     size_t subpages_required = (size / SUBPAGE_SIZE) + (size % SUBPAGE_SIZE ? 1 : 0);
-    uint32_t mask;
-    unsigned int base_page, base_subpage;
+    ssize_t first;
 
-    if (!size || subpages_required > dest->num_subpages || subpages_required > MAX_SUBPAGES_PER_CMD) {
+    if (!size || subpages_required > dest->num_subpages) {
         errno = EINVAL;
         return NULL;
     }
 
-    mask = (uint32_t) ((1 << subpages_required) - 1);
-
-    // Find contigous range of free subpages
-    for (base_page = 0; base_page < (dest->num_subpages * SUBPAGE_SIZE) / PAGE_SIZE; base_page++) {
-        base_subpage = 0;
-        while (base_subpage <= (PAGE_SIZE / SUBPAGE_SIZE) - subpages_required) {
-            if (!((mask << base_subpage) & dest->lock_status[base_page]))
-                return write_into_subpages(dest, subpages_required, src, base_page, base_subpage, mask);
-            base_subpage++;
-        }
+    first = find_free_subpages(dest, subpages_required);
+    if (first < 0) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    // Nothing was found
-    errno = -ENOMEM;
-    return NULL;
+    return write_into_subpages(dest, (size_t) first, subpages_required, src);
 }
 
 static void xom_free_all_subpages_internal(struct xom_subpages *subpages) {
-    p_xombuf xbuf = malloc(sizeof(*xbuf));
-
-    if (xbuf) {
-        *xbuf = (_xombuf) {
-                .address = subpages->address,
-                .allocated_size = subpages->num_subpages * SUBPAGE_SIZE,
-                .locked = 1,
-                .xom_mode = subpages->xom_mode,
-        };
-        xom_free_internal(xbuf);
-    }
+    unmap_xom_range(subpages->address, subpages->mapped_size, subpages->xom_mode, subpages->va_owned);
+    pthread_mutex_destroy(&subpages->lock);
     free(subpages->lock_status);
-    free(subpages);
+    free(subpages->allocation_ends);
+    free_header(subpages);
+}
+
+// Scrub the subpages in mask and unlock them, so that they can be reused
+static int release_subpages(struct xom_subpages *subpages, unsigned int page, uint32_t mask) {
+    unsigned int i, pkru;
+    modxom_cmd cmd;
+    char *page_address = (char *) subpages->address + page * PAGE_SIZE;
+
+    if (subpages->xom_mode == XOM_MODE_SLAT) {
+        cmd = (modxom_cmd) {
+                .cmd = MODXOM_CMD_FREE_SUBPAGES,
+                .num_pages = mask,
+                .base_addr = (uint64_t) (uintptr_t) page_address,
+        };
+        if (write(xomfd, &cmd, sizeof(cmd)) < 0)
+            return -1;
+    } else if (subpages->xom_mode == XOM_MODE_PKU) {
+        pkru = allow_subpage_writes();
+        for (i = 0; i < PAGE_SIZE / SUBPAGE_SIZE; i++) {
+            if (mask & (1u << i))
+                memset(page_address + i * SUBPAGE_SIZE, 0xcc, SUBPAGE_SIZE);
+        }
+        restore_pkru(pkru);
+    } else
+        return -1;
+
+    subpages->lock_status[page] &= ~mask;
+    subpages->free_subpages += __builtin_popcount(mask);
+    if (page < subpages->first_free_page)
+        subpages->first_free_page = page;
+    return 0;
 }
 
 static int xom_free_subpages_internal(struct xom_subpages *subpages, void *base_address) {
+    size_t offset;
+    unsigned int page, last_page, first, last;
+    uint32_t ends;
+
     if (base_address < subpages->address)
         return -1;
     if (base_address >= subpages->address + (subpages->num_subpages * SUBPAGE_SIZE))
         return -1;
 
-    subpages->references--;
-    if (subpages->references <= 0) {
-        xom_free_all_subpages_internal(subpages);
-        return 1;
+    offset = (size_t) ((char *) base_address - (char *) subpages->address);
+    if (offset % SUBPAGE_SIZE)
+        return -1;
+    page = offset / PAGE_SIZE;
+    first = (offset % PAGE_SIZE) / SUBPAGE_SIZE;
+    if (page >= subpages->num_pages || !(subpages->lock_status[page] & (1u << first)))
+        return -1;
+
+    // The allocation spans from its first subpage up to the next allocation end, possibly in a later page
+    ends = subpages->allocation_ends[page] >> first;
+    for (last_page = page; !ends; ends = subpages->allocation_ends[last_page]) {
+        if (++last_page >= subpages->num_pages || !(subpages->lock_status[last_page] & 1))
+            return -1;
     }
-    return 0;
+    last = __builtin_ctz(ends) + (last_page == page ? first : 0);
+
+    for (; page < last_page; page++, first = 0) {
+        if (release_subpages(subpages, page, UINT32_MAX << first) < 0)
+            return -1;
+    }
+    if (release_subpages(subpages, page, (uint32_t) ((2ull << last) - 1) & ~((1u << first) - 1)) < 0)
+        return -1;
+    subpages->allocation_ends[page] &= ~(1u << last);
+
+    // The caller frees the subpages once it has dropped their lock
+    subpages->references--;
+    return subpages->references <= 0;
 }
 
 static inline int get_xom_mode_internal() {
     return (int) xom_mode;
 }
 
+// Called with lib_lock held. Readers of xom_mode do not take it, so buffers keep the mode they were created with
 static int set_xom_mode_internal(const int new_xom_mode) {
     if (new_xom_mode == xom_mode)
         return 0;
@@ -764,30 +1925,69 @@ static int set_xom_mode_internal(const int new_xom_mode) {
     return -1;
 }
 
-static int mark_register_clear_internal(struct xombuf *buf, uint8_t full_clear, size_t page_number) {
+/*
+ * Marks n_pages pages starting at address for register clearing, which modxom forwards with a single hypercall.
+ * Returns the number of marked pages, which is less than n_pages if the hypervisor failed partway through.
+ */
+static ssize_t send_mark_register_clear(void *address, uint8_t footprint, size_t n_pages) {
+    ssize_t marked;
     modxom_cmd cmd = {
             .cmd = MODXOM_CMD_MARK_REG_CLEAR,
-            .base_addr = (uintptr_t) buf->address + (page_number * PAGE_SIZE),
-            .num_pages = full_clear ? REG_CLEAR_TYPE_FULL : REG_CLEAR_TYPE_VECTOR
+            .base_addr = (uintptr_t) address,
+            .num_pages = ((footprint & XOM_REG_CLEAR_FULL) ? REG_CLEAR_TYPE_FULL : REG_CLEAR_TYPE_VECTOR) |
+                         (footprint & REG_CLEAR_WIDTH_MASK) | (uint32_t) (n_pages << REG_CLEAR_PAGES_SHIFT)
     };
 
-    if (buf->pid != libxom_pid)
+    if (footprint & ~(XOM_REG_CLEAR_FULL | REG_CLEAR_WIDTH_MASK))
         return -EINVAL;
 
-    if (xom_mode != XOM_MODE_SLAT || !buf->locked || buf->marked)
+    if (xom_mode != XOM_MODE_SLAT || !n_pages || n_pages > (UINT32_MAX >> REG_CLEAR_PAGES_SHIFT))
         return -EINVAL;
 
-    if (write(xomfd, &cmd, sizeof(cmd)) < 0)
+    marked = write(xomfd, &cmd, sizeof(cmd));
+    if (marked < 0)
         return -errno;
 
-    buf->marked = 1;
+    return marked;
+}
 
-    return 0;
+static int mark_register_clear_internal(struct xombuf *buf, uint8_t footprint, size_t first_page, size_t n_pages) {
+    const size_t buf_pages = SIZE_CEIL(buf->allocated_size) >> PAGE_SHIFT;
+    size_t i;
+    ssize_t marked;
+
+    if (buf->pid != libxom_pid || !buf->locked)
+        return -EINVAL;
+
+    if (!n_pages || first_page >= buf_pages || n_pages > buf_pages - first_page)
+        return -EINVAL;
+
+    if (!buf->marked_pages) {
+        buf->marked_pages = calloc(BITMAP_WORDS(buf_pages), sizeof(*buf->marked_pages));
+        if (!buf->marked_pages)
+            return -ENOMEM;
+    }
+
+    // A page cannot be marked twice, so reject the range before any of its pages is marked
+    for (i = first_page; i < first_page + n_pages; i++) {
+        if (test_page_bit(buf->marked_pages, i))
+            return -EINVAL;
+    }
+
+    marked = send_mark_register_clear((char *) buf->address + first_page * PAGE_SIZE, footprint, n_pages);
+    if (marked < 0)
+        return (int) marked;
+
+    // Pages marked before a failure stay marked, so they must not be offered for marking again
+    for (i = first_page; i < first_page + (size_t) marked; i++)
+        set_page_bit(buf->marked_pages, i);
+
+    return (size_t) marked < n_pages ? -EINVAL : 0;
 }
 
 
 struct xombuf *xom_alloc(size_t size) {
-    wrap_call(struct xombuf*, xomalloc_page_internal(size));
+    return xomalloc_page_internal(size);
 }
 
 size_t xom_get_size(const struct xombuf *buf) {
@@ -797,33 +1997,44 @@ size_t xom_get_size(const struct xombuf *buf) {
 }
 
 int xom_write(struct xombuf *dest, const void *const restrict src, const size_t size, const size_t offset) {
-    wrap_call(int, xom_write_internal(dest, src, size, offset));
+    if (!dest) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    wrap_object_call(int, dest, xom_write_internal(dest, src, size, offset));
 }
 
 void *xom_lock(struct xombuf *buf) {
-    wrap_call(void*, xom_lock_internal(buf));
+    if (!buf) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    wrap_object_call(void*, buf, xom_lock_internal(buf));
 }
 
+// The caller owns buf, so no other thread may use it anymore
 void xom_free(struct xombuf *buf) {
-    __libxom_prologue();
     xom_free_internal(buf);
-    __libxom_epilogue();
 }
 
-int xom_mark_register_clear(struct xombuf *buf, uint8_t full_clear, size_t page_number) {
-    if (page_number * PAGE_SIZE > buf->allocated_size)
-        return -EINVAL;
+int xom_mark_register_clear(struct xombuf *buf, uint8_t footprint, size_t page_number) {
+    wrap_object_call(int, buf, mark_register_clear_internal(buf, footprint, page_number, 1));
+}
 
-    wrap_call(int, mark_register_clear_internal(buf, full_clear, page_number));
+int xom_mark_register_clear_range(struct xombuf *buf, uint8_t footprint, size_t first_page, size_t n_pages) {
+    wrap_object_call(int, buf, mark_register_clear_internal(buf, footprint, first_page, n_pages));
 }
 
-int xom_mark_register_clear_subpage(const struct xom_subpages *subpages, uint8_t full_clear, size_t page_number) {
-    struct xombuf buf = {
-            .address = subpages->address,
-            .allocated_size = (subpages->num_subpages * SUBPAGE_SIZE),
-            .locked = ~0
-    };
-    return xom_mark_register_clear(&buf, full_clear, page_number);
+int xom_mark_register_clear_subpage(const struct xom_subpages *subpages, uint8_t footprint, size_t page_number) {
+    ssize_t marked;
+
+    if (page_number >= (subpages->num_subpages * SUBPAGE_SIZE) / PAGE_SIZE)
+        return -EINVAL;
+
+    marked = send_mark_register_clear((char *) subpages->address + page_number * PAGE_SIZE, footprint, 1);
+    return marked < 0 ? (int) marked : 0;
 }
 
 #if (defined(__x86_64__) || defined(_M_X64))
@@ -849,25 +2060,30 @@ int xom_migrate_shared_libraries(){
 #endif
 
 struct xom_subpages *xom_alloc_subpages(size_t size) {
-    wrap_call(p_xom_subpages, xom_alloc_subpages_internal(size))
+    return xom_alloc_subpages_internal(size);
 }
 
 void *xom_fill_and_lock_subpages(struct xom_subpages *dest, size_t size, const void *const src) {
-    wrap_call(void*, xom_fill_and_lock_subpages_internal(dest, size, src))
+    wrap_object_call(void*, dest, xom_fill_and_lock_subpages_internal(dest, size, src))
 }
 
 int xom_free_subpages(struct xom_subpages *subpages, void *base_address) {
-    wrap_call(int, xom_free_subpages_internal(subpages, base_address))
+    int r;
+
+    pthread_mutex_lock(&subpages->lock);
+    r = xom_free_subpages_internal(subpages, base_address);
+    pthread_mutex_unlock(&subpages->lock);
+    if (r == 1)
+        xom_free_all_subpages_internal(subpages);
+    return r;
 }
 
 void xom_free_all_subpages(struct xom_subpages *subpages) {
-    __libxom_prologue();
     xom_free_all_subpages_internal(subpages);
-    __libxom_epilogue();
 }
 
 int get_xom_mode() {
-    wrap_call(int, get_xom_mode_internal());
+    return get_xom_mode_internal();
 }
 
 int set_xom_mode(const int new_xom_mode) {
@@ -897,6 +2113,8 @@ void initialize_libxom(void) {
 
     pthread_mutex_init(&lib_lock, NULL);
     initialized = 1;
+    resolve_signal_functions();
+    pthread_atfork(libxom_atfork_prepare, libxom_atfork_parent, libxom_atfork_child);
     pthread_mutex_lock(&lib_lock);
 
     pthread_mutexattr_init(&full_reg_clear_lock_attr);
@@ -915,14 +2133,23 @@ void initialize_libxom(void) {
 
 #if (defined(__x86_64__) || defined(_M_X64))
     while (*envp) {
+        // Patterns that select the code to migrate may follow the mode, e.g. LIBXOM_LOCK=libs:libcrypto.so*
+        if (!strncmp(*envp, LIBXOM_ENVVAR "=", sizeof(LIBXOM_ENVVAR)) && strchr(*envp, ':'))
+            parse_migration_patterns(strchr(*envp, ':') + 1);
+
         if (strstr(*envp, LIBXOM_ENVVAR "=" LIBXOM_ENVVAR_LOCK_ALL)) {
             migrate_all_code_internal();
-            migrate_dlopen = 1;
+            migrate_dlopen = TEXT_TYPE_VDSO;
             break;
         }
         if (strstr(*envp, LIBXOM_ENVVAR "=" LIBXOM_ENVVAR_LOCK_LIBS)) {
             migrate_shared_libraries_internal();
-            migrate_dlopen = 1;
+            migrate_dlopen = TEXT_TYPE_EXECUTABLE | TEXT_TYPE_VDSO;
+            break;
+        }
+        if (strstr(*envp, LIBXOM_ENVVAR "=" LIBXOM_ENVVAR_LOCK_LAZY)) {
+            migrate_lazily_internal();
+            migrate_dlopen = TEXT_TYPE_VDSO;
             break;
         }
         envp++;
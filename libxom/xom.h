@@ -18,6 +18,13 @@
 #define XOM_MODE_PKU            1 // XOM is enforced by protection keys (PKU)
 #define XOM_MODE_SLAT           2 // XOM is enforced by SLAT / EPT
 
+// Register footprints for xom_mark_register_clear. Combine one width with XOM_REG_CLEAR_FULL if needed.
+#define XOM_REG_CLEAR_FULL      0x01 // Clear every GPR except for %rbp and %rsp, not only %r14 and %r15
+#define XOM_REG_CLEAR_WIDEST    0x00 // Clear all vector registers of the CPU
+#define XOM_REG_CLEAR_SSE       0x10 // The code only uses %xmm registers
+#define XOM_REG_CLEAR_AVX       0x20 // The code uses %ymm registers, but no AVX-512 state
+#define XOM_REG_CLEAR_AVX512    0x30 // The code uses AVX-512 state
+
 /**
  * A code block initialized with this marco repeats when the registers are cleared
  */
@@ -58,6 +65,15 @@ int expect_full_reg_clear__(void);
  * possible XOM buffer takes up at least 4KB of memory, even if a size smaller
  * than that is specified. If need to repeatedly allocate small chunks of XOM,
  * xom_alloc_subpages instead.
+ * Buffers of 2MB or more are rounded up to a multiple of 2MB and placed at a
+ * 2MB-aligned address, so that they can be mapped with superpages.
+ * The memory is placed on the NUMA node of the calling thread. With SLAT-based
+ * XOM, modxom allocates it on the node of the current CPU. With PKU, it is placed
+ * on the node of the thread that first writes to it, usually through xom_write.
+ * Buffers survive fork(). Children of a pre-forking server execute their parent's
+ * locked buffers from the same physical memory, which stays sealed for as long as
+ * any process maps it. Only the allocating process can write, lock or mark an
+ * inherited buffer, other processes can only execute and free it.
  *  
  * @param size The size of the XOM buffer
  * @returns NULL upon failure, a pointer != NULL otherwise.
@@ -112,6 +128,8 @@ void* xom_lock(struct xombuf* buf);
 
 /**
  * Free a XOM buffer.
+ * Freeing a buffer that was inherited through fork() only removes it from the calling
+ * process, the other processes keep using it.
  * 
  * @param buf The XOM buffer to be freed.
 */
@@ -149,6 +167,7 @@ struct xom_subpages* xom_alloc_subpages(size_t size);
  * in src. If found, the data in src is written into these subpages, which are then locked.
  * Note that each write will occupy at least one 128-byte subpage, so even a 1-byte write
  * will reserve 128-bytes in memory. 
+ * Data of up to a page stays within one page. Larger data may span page boundaries.
  * 
  * @param dest A subpage XOM buffer previously allocated with xom_alloc_subpages
  * @param size The size of the data in src in bytes
@@ -161,11 +180,11 @@ struct xom_subpages* xom_alloc_subpages(size_t size);
 void* xom_fill_and_lock_subpages(struct xom_subpages* dest, unsigned long size, const void *restrict src);
 
 /**
- * Free a XOM buffer that was obtained through xom_fill_and_lock_subpages. Note
- * that this may not release the subpages immediately, as they remain locked in 
- * memory. The subpages are only marked as unused until all subpages in the XOM
- * buffer have been freed with this function. Only then is the memory actually
- * released.
+ * Free a XOM buffer that was obtained through xom_fill_and_lock_subpages. The
+ * subpages are overwritten and unlocked, so that later calls to
+ * xom_fill_and_lock_subpages can reuse them. The memory of the subpage XOM
+ * buffer itself is only released once all subpages in it have been freed with
+ * this function.
  * 
  * @param subpages A subpage XOM buffer previously allocated with xom_alloc_subpages
  * @param base_address A pointer previously obtained through xom_fill_and_lock_subpages
@@ -186,23 +205,40 @@ void xom_free_all_subpages(struct xom_subpages* subpages);
  * Mark a XOM page for register clearing. Only supported for SLAT-based XOM
  *
  * @param buf The XOM buffer containing the target page
- * @param full_clear If set to 0, only clear %r15 and the SSE/AVX registers on interrupt. If set to 1, every register
- *                     except for %rpb and %rsp is cleared
+ * @param footprint The registers to clear on interrupt. Without XOM_REG_CLEAR_FULL, only %r14, %r15 and the vector
+ *                    registers are cleared, otherwise every register except for %rpb and %rsp. One of the
+ *                    XOM_REG_CLEAR_SSE/AVX/AVX512 widths limits vector clearing to the registers the code uses,
+ *                    which makes interrupts cheaper. 0 and 1 keep their meaning from older versions.
  * @param page_number The page's index within the buffer. Can be computed as (byte_offset / PAGE_SIZE).
  * @return 0 upon success, a negative error code upon error.
  */
-int xom_mark_register_clear(struct xombuf *buf, unsigned char full_clear, unsigned long page_number);
+int xom_mark_register_clear(struct xombuf *buf, unsigned char footprint, unsigned long page_number);
+
+/**
+ * Mark a range of pages of a XOM buffer for register clearing. Only supported for SLAT-based XOM
+ * The whole range is forwarded to the hypervisor at once, which is much cheaper than marking each
+ * page with xom_mark_register_clear. A page cannot be marked twice, so the call fails without
+ * marking anything if one of the pages has already been marked. If the hypervisor fails partway
+ * through the range, the pages before the failing one stay marked and cannot be marked again.
+ *
+ * @param buf The XOM buffer containing the target pages
+ * @param footprint The registers to clear on interrupt, see xom_mark_register_clear
+ * @param first_page The index of the first page within the buffer
+ * @param n_pages The number of pages to mark
+ * @return 0 upon success, a negative error code upon error.
+ */
+int xom_mark_register_clear_range(struct xombuf *buf, unsigned char footprint, unsigned long first_page,
+                                  unsigned long n_pages);
 
 /**
  * Mark a XOM page reserved for subpage-XOM for register clearing. Only supported for SLAT-based XOM
  *
  * @param buf The XOM subpage-array containing the target page
- * @param full_clear If set to 0, only clear %r15 and the SSE/AVX registers on interrupt. If set to 1, every register
- *                     except for %rpb and %rsp is cleared
+ * @param footprint The registers to clear on interrupt, see xom_mark_register_clear
  * @param page_number The page's index within the subpage-array. Can be computed as (byte_offset_of_subpage / PAGE_SIZE).
  * @return 0 upon success, a negative error code upon error.
  */
-int xom_mark_register_clear_subpage(const struct xom_subpages *subpages, unsigned char full_clear, unsigned long page_number);
+int xom_mark_register_clear_subpage(const struct xom_subpages *subpages, unsigned char footprint, unsigned long page_number);
 
 
 #ifdef __cplusplus
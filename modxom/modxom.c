@@ -12,8 +12,18 @@
 #include <linux/version.h>
 #include <linux/string.h>
 #include <linux/mm.h>
-#include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/percpu.h>
+#include <linux/interval_tree.h>
+#include <linux/bitmap.h>
+#include <linux/sched/mm.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/kref.h>
 #ifdef CONFIG_XEN
 #include <xen/xen.h>
 #include <asm/xen/hypercall.h>
@@ -33,9 +43,21 @@
 #define MMUEXT_CREATE_XOM_SPAGES                23
 #define MMUEXT_WRITE_XOM_SPAGES                 24
 #define MMUEXT_MARK_REG_CLEAR                   26
+#define MMUEXT_WRITE_XOM_SPAGES_MULTI           27
+#define MMUEXT_FREE_XOM_SPAGES                  28
 
-#define READ_HEADER_STRING                      "        Address:             Size:\n"
-#define MAPPING_LINE_SIZE                       ((2 * (2 * sizeof(size_t) + 2)) + 5)
+// Mappings are backed by blocks of this order where possible, which Xen seals with 2MB EPT entries
+#define MAPPING_BLOCK_ORDER                     9
+#define MAPPING_BLOCK_PAGES                     (1u << MAPPING_BLOCK_ORDER)
+
+// Physically contiguous runs of pages that xom_invoke_xen submits per hypercall
+#define MODXOM_OPS_PER_HYPERCALL                16
+
+// Physically contiguous source pages for subpage writes, one batch of runs per hypercall and CPU
+#define MODXOM_OPERAND_PAGES                    8
+
+#define READ_HEADER_STRING                      "        Address:             Size:  Hypercalls:\n"
+#define MAPPING_LINE_SIZE                       ((3 * (2 * sizeof(size_t) + 2)) + 5)
 
 #ifndef MIN
 #define MIN(X, Y)                               ((X) < (Y) ? (X) : (Y))
@@ -46,26 +68,89 @@
 #define set_lock_status(pmapping, index, val) \
     page_l_arr_index(pmapping, index) = (page_l_arr_index(pmapping, index) & ~(1 << ((index) & 0x7))) | (((val) ? 1 : 0) << ((index) & 0x7))
 
+/*
+ * A mapping is referenced by the process entry that created it, for as long as it is in its tree,
+ * and by every VMA that maps it. VMAs are duplicated on fork, so a child keeps the sealed pages
+ * alive and mapped after the parent has freed them. The pages are unsealed and freed only once
+ * the last reference is dropped.
+ */
 typedef struct {
-    struct list_head lhead;
+    struct interval_tree_node it;
+    struct kref refs;
     unsigned int num_pages;
     unsigned long uaddr;
-    unsigned long kaddr;
-    pfn_t pfn;
+    struct page **pages;              // Backing page of every page of the mapping
+    unsigned long *huge_blocks;       // Blocks of MAPPING_BLOCK_PAGES pages that are a single allocation
     uint8_t *lock_status;
     bool subpage_level;
+    // Number of hypercalls that the last change of the mapping's protection took
+    unsigned int hypercalls;
 } xom_mapping, *pxom_mapping;
 
+/*
+ * State of the process that opened /proc/xom, stored in the file's private_data. Mappings are
+ * kept in an interval tree over their user address ranges. Commands that only look mappings up,
+ * like subpage writes, take lock for reading and may run concurrently, everything that changes a
+ * mapping takes it for writing. The lock is taken after mmap_lock, so it must not be held while
+ * unmapping memory or accessing user memory.
+ */
 typedef struct {
-    struct list_head lhead;
-    pid_t pid;
-    struct list_head mappings;
-    struct list_head locked_in_place;
+    struct rw_semaphore lock;
+    struct mm_struct *mm;
+    struct rb_root_cached mappings;
 } xom_process_entry, *pxom_process_entry;
 
-LIST_HEAD(xom_entries);
-static struct mutex file_lock;
-static uint8_t *modxom_src_operand_page;
+// Source pages that subpage writes are copied into straight from user memory
+typedef struct {
+    struct mutex lock;
+    uint8_t *pages;
+} modxom_operand, *pmodxom_operand;
+
+// Pre-zeroed pages with PG_reserved set, which new mappings take their memory from
+typedef struct {
+    spinlock_t lock;
+    struct list_head entries;         // Linked through the lru field of each entry's first page
+    unsigned int count;
+    unsigned int order;
+    unsigned int *watermark;
+} xom_reserve, *pxom_reserve;
+
+// Each NUMA node has its own reserves, so that mappings are backed by memory local to the calling CPU
+typedef struct {
+    xom_reserve blocks;
+    xom_reserve pages;
+} xom_node_reserves;
+
+static DEFINE_PER_CPU(modxom_operand, modxom_operands);
+
+static unsigned int reserve_blocks = 4;
+static unsigned int reserve_pages = 256;
+
+// Indexed by node id, allocated in modxom_init
+static xom_node_reserves *node_reserves;
+
+static void refill_reserves(struct work_struct *work);
+static DECLARE_WORK(refill_work, refill_reserves);
+
+// Changing a watermark at runtime brings the reserve to its new size right away
+static int set_watermark(const char *val, const struct kernel_param *kp) {
+    int status = param_set_uint(val, kp);
+
+    // While the module is loading, modxom_init does the initial fill
+    if (!status && node_reserves)
+        schedule_work(&refill_work);
+    return status;
+}
+
+static const struct kernel_param_ops watermark_ops = {
+        .set = set_watermark,
+        .get = param_get_uint
+};
+
+module_param_cb(reserve_blocks, &watermark_ops, &reserve_blocks, 0644);
+MODULE_PARM_DESC(reserve_blocks, "Number of pre-zeroed 2MB blocks kept ready for new mappings, per NUMA node");
+module_param_cb(reserve_pages, &watermark_ops, &reserve_pages, 0644);
+MODULE_PARM_DESC(reserve_pages, "Number of pre-zeroed single pages kept ready for new mappings, per NUMA node");
 
 static bool were_pages_locked(pxom_mapping mapping) {
     unsigned int i;
@@ -77,119 +162,318 @@ static bool were_pages_locked(pxom_mapping mapping) {
     return ret > 0;
 }
 
-// Simulate Xen hypercall
-static int hypercall(struct mmuext_op *op, int nr_ents, int domid, void *gfns) {
+// Simulate Xen hypercall, done receives the number of entries of op that were processed
+static int hypercall(struct mmuext_op *op, int nr_ents, unsigned int *done, domid_t domid) {
     #ifdef CONFIG_XEN
-    return HYPERVISOR_mmuext_op(op, nr_ents, gfns, domid);
+    return HYPERVISOR_mmuext_op(op, nr_ents, (int *) done, domid);
     #elif CONFIG_SEV
+    if (done)
+        *done = nr_ents;
     return 0;
     #else
+    if (done)
+        *done = nr_ents;
     return 0;
     #endif
 }
 
-// Add or remove hypervisor protection
+static unsigned long mapping_gfn(pxom_mapping mapping, unsigned int page_index) {
+    return page_to_pfn(mapping->pages[page_index]);
+}
+
+/*
+ * Add or remove hypervisor protection. The range is split into physically contiguous runs, and up to
+ * MODXOM_OPS_PER_HYPERCALL runs are submitted with a single hypercall. Xen transparently restarts a
+ * preempted batch and may rewrite the entries while doing so, so the run lengths are kept separately.
+ */
 static int
 xom_invoke_xen(pxom_mapping mapping, unsigned int page_index, unsigned int num_pages, unsigned int mmuext_cmd) {
     int status;
-    struct mmuext_op op;
-    pfn_t *gfns;
-    unsigned int page_c, i, pages_locked = 0;
-    unsigned long cur_gfn = mapping->pfn.val, base_gfn = cur_gfn, last_gfn;
+    struct mmuext_op ops[MODXOM_OPS_PER_HYPERCALL];
+    unsigned int run_pages[MODXOM_OPS_PER_HYPERCALL];
+    unsigned int nr_ops = 0, done, i, j, pages_batched = 0, pages_locked = 0;
+    unsigned long base_gfn;
 
     if (!num_pages)
         return 0;
     if (page_index + num_pages > mapping->num_pages)
         return -EINVAL;
-    memset(&op, 0, sizeof(op));
-
-    gfns = kvmalloc(sizeof(*gfns) * mapping->num_pages, GFP_KERNEL);
-    if (!gfns)
-        return -ENOMEM;
-
-    while (pages_locked < num_pages) {
-        page_c = 0;
+    memset(ops, 0, sizeof(ops));
+    mapping->hypercalls = 0;
 
+    while (pages_batched < num_pages) {
         // Group into physically contiguous ranges
-        do {
-            page_c++;
-            if (page_c + pages_locked >= mapping->num_pages)
-                break;
-            last_gfn = cur_gfn;
-            cur_gfn = virt_to_phys((void *) (mapping->kaddr + (pages_locked + page_c) * PAGE_SIZE)) >> PAGE_SHIFT;
-        } while (last_gfn == cur_gfn - 1);
-
-        // Perform Hypercall for range
-        op.cmd = mmuext_cmd;
-        op.arg1.mfn = base_gfn;
-        op.arg2.nr_ents = page_c;
+        base_gfn = mapping_gfn(mapping, page_index + pages_batched);
+        run_pages[nr_ops] = 1;
+        while (pages_batched + run_pages[nr_ops] < num_pages &&
+               mapping_gfn(mapping, page_index + pages_batched + run_pages[nr_ops]) == base_gfn + run_pages[nr_ops])
+            run_pages[nr_ops]++;
+
+        ops[nr_ops].cmd = mmuext_cmd;
+        ops[nr_ops].arg1.mfn = base_gfn;
+        ops[nr_ops].arg2.nr_ents = run_pages[nr_ops];
+        pages_batched += run_pages[nr_ops++];
+        if (nr_ops < MODXOM_OPS_PER_HYPERCALL && pages_batched < num_pages)
+            continue;
+
 #ifdef MODXOM_DEBUG
-        printk(KERN_INFO "[MODXOM] Invoking Hypervisor with mfn 0x%lx for %u pages\n", op.arg1.mfn, op.arg2.nr_ents);
+        printk(KERN_INFO "[MODXOM] Invoking Hypervisor with %u ranges, starting at mfn 0x%lx\n", nr_ops, ops[0].arg1.mfn);
 #endif
-        status = hypercall(&op, 1, NULL, DOMID_SELF);
+        done = 0;
+        status = hypercall(ops, nr_ops, &done, DOMID_SELF);
+        mapping->hypercalls++;
+
+        // Update lock status in mapping struct, also for the ranges that completed before a failure
+        for (i = 0; i < done && i < nr_ops; i++) {
+            for (j = 0; j < run_pages[i]; j++)
+                set_lock_status(mapping, page_index + pages_locked + j, 1);
+            pages_locked += run_pages[i];
+        }
+
         if (status) {
 #ifdef MODXOM_DEBUG
             printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
 #endif
-            status = -EINVAL;
-            goto exit;
+            return -EINVAL;
         }
 
-        // Update lock status in mapping struct
-        for (i = 0; i < page_c; i++)
-            set_lock_status(mapping, page_index + pages_locked + i, 1);
-
-        base_gfn = cur_gfn;
-        pages_locked += page_c;
+        nr_ops = 0;
         // Repeat until all physically contiguous ranges are locked
     }
 
-    exit:
-    kvfree(gfns);
-    return status;
+    return 0;
 }
 
-static int release_mapping(pxom_mapping mapping) {
-    int status = 0;
-    unsigned long i;
+// Allocates 2^order zeroed pages on node nid and sets their PG_reserved bit to prevent swapping
+static struct page *alloc_reserved_pages(int nid, unsigned int order, gfp_t gfp) {
+    unsigned int i;
+    struct page *page = alloc_pages_node(nid, gfp | __GFP_ZERO, order);
 
-    if (were_pages_locked(mapping)) {
-        status = xom_invoke_xen(mapping, 0, mapping->num_pages, MMUEXT_UNMARK_XOM);
-        if (status)
-            return status;
+    if (!page)
+        return NULL;
+    for (i = 0; i < (1u << order); i++)
+        SetPageReserved(page + i);
+    return page;
+}
+
+static void free_reserved_pages(struct page *page, unsigned int order) {
+    unsigned int i;
+
+    for (i = 0; i < (1u << order); i++)
+        ClearPageReserved(page + i);
+    __free_pages(page, order);
+}
+
+static struct page *take_from_reserve(pxom_reserve reserve) {
+    struct page *page = NULL;
+
+    spin_lock(&reserve->lock);
+    if (reserve->count) {
+        page = list_first_entry(&reserve->entries, struct page, lru);
+        list_del(&page->lru);
+        reserve->count--;
     }
+    spin_unlock(&reserve->lock);
+    return page;
+}
 
-    for (i = 0; i < mapping->num_pages * PAGE_SIZE; i += PAGE_SIZE)
-        ClearPageReserved(virt_to_page(mapping->kaddr + i));
+// Allocates or frees entries until the reserve matches its watermark, or memory runs out
+static void refill_reserve(pxom_reserve reserve, int nid, gfp_t gfp) {
+    struct page *page;
+    unsigned int watermark;
+
+    for (;;) {
+        watermark = READ_ONCE(*reserve->watermark);
+        spin_lock(&reserve->lock);
+        if (reserve->count > watermark) {
+            page = list_first_entry(&reserve->entries, struct page, lru);
+            list_del(&page->lru);
+            reserve->count--;
+            spin_unlock(&reserve->lock);
+            free_reserved_pages(page, reserve->order);
+            continue;
+        }
+        spin_unlock(&reserve->lock);
+        if (reserve->count == watermark)
+            return;
+
+        page = alloc_reserved_pages(nid, reserve->order, gfp);
+        if (!page)
+            return;
+
+        spin_lock(&reserve->lock);
+        list_add(&page->lru, &reserve->entries);
+        reserve->count++;
+        spin_unlock(&reserve->lock);
+    }
+}
 
-    // Don't mess with a dying processes address space
-    if (!(current->flags & PF_EXITING)) {
-        status = vm_munmap(mapping->uaddr, mapping->num_pages * PAGE_SIZE);
+// Reserves only hold memory of their own node, falling back to other nodes is left to the mapping
+static void refill_reserves(struct work_struct *__attribute__((unused)) work) {
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+        refill_reserve(&node_reserves[nid].blocks, nid, GFP_KERNEL | __GFP_THISNODE | __GFP_NORETRY | __GFP_NOWARN);
+        refill_reserve(&node_reserves[nid].pages, nid, GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN);
     }
+}
 
-    if (status)
-        return status;
+static void init_reserve(pxom_reserve reserve, unsigned int order, unsigned int *watermark) {
+    spin_lock_init(&reserve->lock);
+    INIT_LIST_HEAD(&reserve->entries);
+    reserve->count = 0;
+    reserve->order = order;
+    reserve->watermark = watermark;
+}
+
+static void drain_reserve(pxom_reserve reserve) {
+    struct page *page;
 
-    if (mapping->kaddr)
-        free_pages(mapping->kaddr, get_order(mapping->num_pages * PAGE_SIZE));
+    while ((page = take_from_reserve(reserve)))
+        free_reserved_pages(page, reserve->order);
+}
 
-    if (mapping->lock_status) {
-        kfree(mapping->lock_status);
-        mapping->lock_status = NULL;
+/*
+ * Backs the mapping with MAPPING_BLOCK_ORDER blocks, so that Xen can seal them as superpages. When
+ * memory is too fragmented for a block, and for the tail of the mapping, it falls back to single pages.
+ * Memory is taken from the node of the calling CPU, or the nearest node with memory, and only comes
+ * from other nodes when that one is exhausted. The pre-zeroed reserves of the node are used first,
+ * and refilled in the background.
+ */
+static int alloc_mapping_pages(pxom_mapping mapping) {
+    unsigned int i, j, block_pages;
+    struct page *page;
+    int nid = numa_mem_id();
+    xom_node_reserves *reserves = &node_reserves[nid];
+
+    schedule_work(&refill_work);
+
+    for (i = 0; i < mapping->num_pages; i += MAPPING_BLOCK_PAGES) {
+        block_pages = MIN(MAPPING_BLOCK_PAGES, mapping->num_pages - i);
+
+        page = NULL;
+        if (block_pages == MAPPING_BLOCK_PAGES) {
+            page = take_from_reserve(&reserves->blocks);
+            if (!page)
+                page = alloc_reserved_pages(nid, MAPPING_BLOCK_ORDER, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+        }
+        if (page) {
+            set_bit(i / MAPPING_BLOCK_PAGES, mapping->huge_blocks);
+            for (j = 0; j < block_pages; j++)
+                mapping->pages[i + j] = page + j;
+            continue;
+        }
+
+        for (j = 0; j < block_pages; j++) {
+            page = take_from_reserve(&reserves->pages);
+            if (!page)
+                page = alloc_reserved_pages(nid, 0, GFP_KERNEL);
+            if (!page)
+                return -ENOMEM;
+            mapping->pages[i + j] = page;
+        }
     }
+    return 0;
+}
+
+// Frees the backing pages of a mapping, which may be partially allocated, along with its page arrays
+static void free_mapping_pages(pxom_mapping mapping) {
+    unsigned int i;
+
+    for (i = 0; mapping->pages && i < mapping->num_pages; i++) {
+        if (!mapping->pages[i])
+            continue;
+        // Blocks are freed as a whole together with their last page
+        if (!test_bit(i / MAPPING_BLOCK_PAGES, mapping->huge_blocks))
+            free_reserved_pages(mapping->pages[i], 0);
+        else if (i % MAPPING_BLOCK_PAGES == MAPPING_BLOCK_PAGES - 1)
+            free_reserved_pages(mapping->pages[i + 1 - MAPPING_BLOCK_PAGES], MAPPING_BLOCK_ORDER);
+    }
+
+    kvfree(mapping->pages);
+    mapping->pages = NULL;
+    bitmap_free(mapping->huge_blocks);
+    mapping->huge_blocks = NULL;
+    kvfree(mapping->lock_status);
+    mapping->lock_status = NULL;
+}
 
+// Maps every physically contiguous run of the mapping's pages into vma
+static int remap_mapping_pages(pxom_mapping mapping, struct vm_area_struct *vma) {
+    int status;
+    unsigned int i = 0, run;
+
+    while (i < mapping->num_pages) {
+        run = 1;
+        while (i + run < mapping->num_pages && mapping_gfn(mapping, i + run) == mapping_gfn(mapping, i) + run)
+            run++;
+        status = remap_pfn_range(vma, vma->vm_start + i * PAGE_SIZE, mapping_gfn(mapping, i),
+                                 run * PAGE_SIZE, PAGE_SHARED_EXEC);
+        if (status < 0)
+            return status;
+        i += run;
+    }
     return 0;
 }
 
-static pxom_process_entry get_process_entry(void) {
-    pxom_process_entry curr_entry = (pxom_process_entry) xom_entries.next;
+static void destroy_mapping(struct kref *ref) {
+    pxom_mapping mapping = container_of(ref, xom_mapping, refs);
 
-    while ((void *) curr_entry != &xom_entries && curr_entry) {
-        if (curr_entry->pid == current->pid)
-            return curr_entry;
-        curr_entry = (pxom_process_entry) curr_entry->lhead.next;
+    // Pages that are still sealed must never be handed back to the kernel, so leak them instead
+    if (were_pages_locked(mapping) && xom_invoke_xen(mapping, 0, mapping->num_pages, MMUEXT_UNMARK_XOM)) {
+        pr_warn("[MODXOM] Could not unseal mapping at 0x%lx, leaking %u pages\n", mapping->uaddr,
+                mapping->num_pages);
+        return;
     }
 
+    free_mapping_pages(mapping);
+    kfree(mapping);
+}
+
+static void put_mapping(pxom_mapping mapping) {
+    kref_put(&mapping->refs, destroy_mapping);
+}
+
+/*
+ * Fork duplicates the VMA, the child's copy maps the same pages. Every VMA also pins the module,
+ * as it may outlive the file and would otherwise call into unloaded code when it is unmapped.
+ */
+static void xom_vma_open(struct vm_area_struct *vma) {
+    pxom_mapping mapping = vma->vm_private_data;
+
+    __module_get(THIS_MODULE);
+    kref_get(&mapping->refs);
+}
+
+static void xom_vma_close(struct vm_area_struct *vma) {
+    put_mapping(vma->vm_private_data);
+    module_put(THIS_MODULE);
+}
+
+// A VMA must keep covering its whole mapping at its original address
+static int xom_vma_may_split(struct vm_area_struct *__attribute__((unused)) vma,
+                             unsigned long __attribute__((unused)) addr) {
+    return -EINVAL;
+}
+
+static int xom_vma_mremap(struct vm_area_struct *__attribute__((unused)) vma) {
+    return -EINVAL;
+}
+
+static const struct vm_operations_struct xom_vm_ops = {
+        .open = xom_vma_open,
+        .close = xom_vma_close,
+        .may_split = xom_vma_may_split,
+        .mremap = xom_vma_mremap,
+};
+
+// Only the process that opened the file may use it, not e.g. a child that inherited the descriptor
+static pxom_process_entry get_process_entry(struct file *f) {
+    pxom_process_entry curr_entry = f->private_data;
+
+    if (curr_entry && curr_entry->mm == current->mm)
+        return curr_entry;
+
 #ifdef MODXOM_DEBUG
     printk(KERN_INFO "[MODXOM] Could not get process entry for PID: %d\n", current->pid);
 #endif
@@ -197,56 +481,59 @@ static pxom_process_entry get_process_entry(void) {
     return NULL;
 }
 
+// Get the mapping that contains addr
+static pxom_mapping find_mapping(pxom_process_entry curr_entry, unsigned long addr) {
+    struct interval_tree_node *node = interval_tree_iter_first(&curr_entry->mappings, addr, addr);
+
+    return node ? container_of(node, xom_mapping, it) : NULL;
+}
+
+/*
+ * Only called once the file is released. Every VMA holds a reference to the file, so none of
+ * the mappings is mapped anymore, also not in any child, and there is nothing to unmap.
+ */
 static int release_process(pxom_process_entry curr_entry) {
-    pxom_mapping last_mapping, curr_mapping;
+    struct rb_node *node;
+    pxom_mapping curr_mapping;
 
     if (!curr_entry)
         return -EINVAL;
 
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        release_mapping(curr_mapping);
-        last_mapping = curr_mapping;
-        curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-        kfree(last_mapping);
+    while ((node = rb_first_cached(&curr_entry->mappings))) {
+        curr_mapping = rb_entry(node, xom_mapping, it.rb);
+        interval_tree_remove(&curr_mapping->it, &curr_entry->mappings);
+        put_mapping(curr_mapping);
     }
     return 0;
 }
 
-static int xmem_free(pmodxom_cmd cmd) {
-    int status;
-    pxom_process_entry curr_entry;
+/*
+ * The mapping is taken out of the tree first, so that it can be unmapped without holding the lock.
+ * Children that inherited it keep it mapped until they unmap it themselves.
+ */
+static int xmem_free(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
+    int status = 0;
     pxom_mapping curr_mapping;
 
-    curr_entry = get_process_entry();
-    if (!curr_entry)
-        return -EBADF;
-
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (curr_mapping->uaddr != cmd->base_addr) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
-
-        if (curr_mapping->num_pages != cmd->num_pages)
-            return -EINVAL;
+    down_write(&curr_entry->lock);
+    curr_mapping = find_mapping(curr_entry, cmd->base_addr);
+    if (!curr_mapping || curr_mapping->uaddr != cmd->base_addr || curr_mapping->num_pages != cmd->num_pages) {
+        up_write(&curr_entry->lock);
+        return -EINVAL;
+    }
+    interval_tree_remove(&curr_mapping->it, &curr_entry->mappings);
+    up_write(&curr_entry->lock);
 
-        status = release_mapping(curr_mapping);
+    // Don't mess with a dying processes address space
+    if (!(current->flags & PF_EXITING))
+        status = vm_munmap(curr_mapping->uaddr, curr_mapping->num_pages * PAGE_SIZE);
 
-        if (status)
-            return status;
-        list_del(&(curr_mapping->lhead));
-        kfree(curr_mapping);
-        return 0;
-    }
-    return -EINVAL;
+    put_mapping(curr_mapping);
+    return status;
 }
 
-static int lock_pages(pmodxom_cmd cmd) {
+static int lock_pages(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
     unsigned page_index;
-    pxom_process_entry curr_entry;
     pxom_mapping curr_mapping;
 
 #ifdef MODXOM_DEBUG
@@ -254,28 +541,20 @@ static int lock_pages(pmodxom_cmd cmd) {
         cmd->base_addr, cmd->num_pages, current->pid);
 #endif
 
-    curr_entry = get_process_entry();
-    if (!curr_entry)
-        return -EBADF;
+    curr_mapping = find_mapping(curr_entry, cmd->base_addr);
+    if (!curr_mapping)
+        goto fail;
 
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (cmd->base_addr < curr_mapping->uaddr ||
-            cmd->base_addr >= curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
+    if (curr_mapping->subpage_level)
+        goto fail;
 
-        if (curr_mapping->subpage_level)
-            goto fail;
+    if (cmd->base_addr + cmd->num_pages * PAGE_SIZE > curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE)
+        goto fail;
 
-        if (cmd->base_addr + cmd->num_pages * PAGE_SIZE > curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE)
-            goto fail;
+    page_index = (cmd->base_addr - curr_mapping->uaddr) / PAGE_SIZE;
 
-        page_index = (cmd->base_addr - curr_mapping->uaddr) / PAGE_SIZE;
+    return xom_invoke_xen(curr_mapping, page_index, cmd->num_pages, MMUEXT_MARK_XOM);
 
-        return xom_invoke_xen(curr_mapping, page_index, cmd->num_pages, MMUEXT_MARK_XOM);
-    }
     fail:
 #ifdef MODXOM_DEBUG
     printk(KERN_INFO "[MODXOM] lock_pages - Failed!, PID: %d\n", current->pid);
@@ -283,294 +562,417 @@ static int lock_pages(pmodxom_cmd cmd) {
     return -EINVAL;
 }
 
-static int xom_init_subpages(pmodxom_cmd cmd) {
+static int xom_init_subpages(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
     int status;
-    pxom_process_entry curr_entry;
     pxom_mapping curr_mapping;
 
-    curr_entry = get_process_entry();
-    if (!curr_entry)
-        return -EBADF;
-
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (cmd->base_addr < curr_mapping->uaddr ||
-            cmd->base_addr >= curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
+    curr_mapping = find_mapping(curr_entry, cmd->base_addr);
+    if (!curr_mapping)
+        return -EINVAL;
 
-        if (curr_mapping->subpage_level)
-            return -EINVAL;
+    if (curr_mapping->subpage_level)
+        return -EINVAL;
 
-        if (cmd->base_addr != curr_mapping->uaddr)
-            return -EINVAL;
+    if (cmd->base_addr != curr_mapping->uaddr)
+        return -EINVAL;
 
-        if (cmd->num_pages != curr_mapping->num_pages)
-            return -EINVAL;
+    if (cmd->num_pages != curr_mapping->num_pages)
+        return -EINVAL;
 
-        status = xom_invoke_xen(curr_mapping, 0, curr_mapping->num_pages, MMUEXT_CREATE_XOM_SPAGES);
-        if (status >= 0)
-            curr_mapping->subpage_level = true;
+    status = xom_invoke_xen(curr_mapping, 0, curr_mapping->num_pages, MMUEXT_CREATE_XOM_SPAGES);
+    if (status >= 0)
+        curr_mapping->subpage_level = true;
 
-        return status;
-    }
-    return -EINVAL;
+    return status;
 }
 
-static pxom_mapping get_new_mapping(struct vm_area_struct *vma, pxom_process_entry curr_entry) {
+static pxom_mapping get_new_mapping(struct vm_area_struct *vma) {
     unsigned long size = (vma->vm_end - vma->vm_start);
-    void *newmem = NULL;
-    uint8_t *n_lock_status = NULL;
-    unsigned int i;
-    int status;
-    pfn_t pfn;
-    pxom_mapping new_mapping = NULL;
-
-    if (!curr_entry)
-        return NULL;
+    unsigned int num_pages;
+    pxom_mapping new_mapping;
 
     // Must be page-aligned
     if (size % PAGE_SIZE || vma->vm_start % PAGE_SIZE || !size) {
         return NULL;
     }
 
-    if (size > (1 << (MAX_ORDER - 1)) << PAGE_SHIFT)
+    if (size / PAGE_SIZE > UINT_MAX)
         return NULL;
+    num_pages = size / PAGE_SIZE;
 
     new_mapping = kmalloc(sizeof(*new_mapping), GFP_KERNEL);
     if (!new_mapping)
         return NULL;
 
-    n_lock_status = kmalloc(((size / PAGE_SIZE) >> 3) + 1, GFP_KERNEL);
-    if (!n_lock_status)
-        goto fail;
-
-    memset(n_lock_status, 0, ((size / PAGE_SIZE) >> 3) + 1);
+    *new_mapping = (xom_mapping) {
+            .refs = KREF_INIT(1),
+            .it.start = vma->vm_start,
+            .it.last = vma->vm_end - 1,
+            .num_pages = num_pages,
+            .uaddr = vma->vm_start,
+            .pages = kvcalloc(num_pages, sizeof(*new_mapping->pages), GFP_KERNEL),
+            .huge_blocks = bitmap_zalloc(DIV_ROUND_UP(num_pages, MAPPING_BLOCK_PAGES), GFP_KERNEL),
+            .lock_status = kvzalloc((num_pages >> 3) + 1, GFP_KERNEL),
+            .subpage_level = false
+    };
 
-    newmem = (void *) __get_free_pages(GFP_KERNEL, get_order(size));
-    if (!newmem || (ssize_t) newmem == -1)
+    if (!new_mapping->pages || !new_mapping->huge_blocks || !new_mapping->lock_status)
         goto fail;
 
-    // Set PG_reserved bit to prevent swapping
-    for (i = 0; i < size; i += PAGE_SIZE)
-        SetPageReserved(virt_to_page(newmem + i));
-
-    memset(newmem, 0x0, PAGE_SIZE * (1 << get_order(size)));
-
-    pfn = (pfn_t) {virt_to_phys(newmem) >> PAGE_SHIFT};
-    status = remap_pfn_range(vma, vma->vm_start, pfn.val, size, PAGE_SHARED_EXEC);
-
-    if (status < 0)
+    if (alloc_mapping_pages(new_mapping) < 0)
         goto fail;
 
-    *new_mapping = (xom_mapping) {
-            .num_pages = size / PAGE_SIZE,
-            .uaddr = vma->vm_start,
-            .kaddr = (unsigned long) newmem,
-            .subpage_level = false,
-            .pfn = pfn,
-            .lock_status = n_lock_status
-    };
+    if (remap_mapping_pages(new_mapping, vma) < 0)
+        goto fail;
 
     return new_mapping;
 
     fail:
-    if (curr_entry)
-        kfree(curr_entry);
-    if (n_lock_status)
-        kfree(n_lock_status);
-    if (newmem)
-        __free_pages(virt_to_page(newmem), get_order(size));
+    free_mapping_pages(new_mapping);
+    kfree(new_mapping);
     return NULL;
 }
 
+/*
+ * Called from mmap, after the kernel has already unmapped whatever the new VMA replaces. Any XOM
+ * mapping in that range is therefore gone from user space and only has to be released.
+ */
 static int manage_mapping_intersection(struct vm_area_struct *vma, pxom_process_entry curr_entry) {
-    int status;
     pxom_mapping curr_mapping;
+    struct interval_tree_node *node;
 
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (vma->vm_end < curr_mapping->uaddr ||
-            vma->vm_start >= curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
-        // The new VMA must fully contain the old mapping, we cannot proceed otherwise
-        if (curr_mapping->uaddr < vma->vm_start ||
-            curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE > vma->vm_end)
-            return 1;
-        status = release_mapping(curr_mapping);
-        if (status)
-            return status;
-        list_del(&(curr_mapping->lhead));
-        kfree(curr_mapping);
-        break;
-    }
+    node = interval_tree_iter_first(&curr_entry->mappings, vma->vm_start, vma->vm_end - 1);
+    if (!node)
+        return 0;
+    curr_mapping = container_of(node, xom_mapping, it);
+
+    // The new VMA must fully contain the old mapping, we cannot proceed otherwise
+    if (curr_mapping->uaddr < vma->vm_start ||
+        curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE > vma->vm_end)
+        return 1;
+    interval_tree_remove(&curr_mapping->it, &curr_entry->mappings);
+    put_mapping(curr_mapping);
     return 0;
 }
 
-static int xom_subpage_write_xen(pmodxom_cmd cmd) {
+/*
+ * Returns the operand pages of the current CPU, locked. The task may migrate afterwards, which is
+ * harmless, as the mutex and not the CPU owns the pages. Spreading writers over CPUs merely keeps
+ * them from contending for a single buffer.
+ */
+static pmodxom_operand get_operand(void) {
+    pmodxom_operand operand = per_cpu_ptr(&modxom_operands, raw_smp_processor_id());
+
+    mutex_lock(&operand->lock);
+    return operand;
+}
+
+static void put_operand(pmodxom_operand operand) {
+    mutex_unlock(&operand->lock);
+}
+
+static int xom_subpage_write_xen(pxom_process_entry curr_entry, pmodxom_cmd cmd, pmodxom_operand operand) {
     int status;
     struct mmuext_op op;
-    pxom_process_entry curr_entry;
     pxom_mapping curr_mapping;
 
-    curr_entry = get_process_entry();
-    if (!curr_entry)
-        return -EBADF;
-
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (cmd->base_addr < curr_mapping->uaddr ||
-            cmd->base_addr >= curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
+    curr_mapping = find_mapping(curr_entry, cmd->base_addr);
+    if (!curr_mapping)
+        return -EINVAL;
 
-        if (!curr_mapping->subpage_level)
-            return -EINVAL;
+    if (!curr_mapping->subpage_level)
+        return -EINVAL;
 
-        op.cmd = MMUEXT_WRITE_XOM_SPAGES;
-        op.arg1.mfn =
-                virt_to_phys((void *) (curr_mapping->kaddr + (cmd->base_addr - curr_mapping->uaddr))) >> PAGE_SHIFT;
-        op.arg2.src_mfn = virt_to_phys(modxom_src_operand_page) >> PAGE_SHIFT;
+    op.cmd = MMUEXT_WRITE_XOM_SPAGES;
+    op.arg1.mfn = mapping_gfn(curr_mapping, (cmd->base_addr - curr_mapping->uaddr) >> PAGE_SHIFT);
+    op.arg2.src_mfn = virt_to_phys(operand->pages) >> PAGE_SHIFT;
 #ifdef MODXOM_DEBUG
-        printk(KERN_INFO "[MODXOM] Invoking hypervisor with dest_mfn 0x%lx and src_mfn 0x%lx\n", op.arg1.mfn, op.arg2.src_mfn);
+    printk(KERN_INFO "[MODXOM] Invoking hypervisor with dest_mfn 0x%lx and src_mfn 0x%lx\n", op.arg1.mfn, op.arg2.src_mfn);
 #endif
-        status = hypercall(&op, 1, NULL, DOMID_SELF);
-        if (status) {
+    status = hypercall(&op, 1, NULL, DOMID_SELF);
+    if (status) {
 #ifdef MODXOM_DEBUG
-            printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
+        printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
 #endif
-            return -EINVAL;
-        }
-        return 0;
+        return -EINVAL;
     }
-    return -EINVAL;
+    return 0;
 }
 
-static ssize_t xom_write_into_subpages(struct file *f, const char __user *user_mem, size_t len, loff_t *offset){
+// The write info is copied from user memory into the operand page before taking the process lock
+static ssize_t
+xom_write_into_subpages(pxom_process_entry curr_entry, pmodxom_cmd cmd, const char __user *user_mem, size_t len) {
     ssize_t ret = -EINVAL;
-    xom_subpage_write *cmd = NULL;
+    pmodxom_operand operand;
+    xom_subpage_write_command *xen_cmd;
+    size_t xen_cmd_len = len - sizeof(*cmd);
 
-    if ((uintptr_t)modxom_src_operand_page & (PAGE_SIZE - 1))
-        return -EFAULT;
+    if (cmd->cmd != MODXOM_CMD_WRITE_SUBPAGES)
+        return -EINVAL;
 
-    if(len < sizeof(cmd->mxom_cmd) + sizeof(cmd->xen_cmd.num_subpages))
+    if (xen_cmd_len < sizeof(xen_cmd->num_subpages) || xen_cmd_len > PAGE_SIZE)
         return -EINVAL;
 
-    cmd = kvmalloc(len, GFP_KERNEL);
-    if(!cmd || !~(uintptr_t)cmd)
-        return -ENOMEM;
+    operand = get_operand();
+    xen_cmd = (xom_subpage_write_command *) operand->pages;
 
-    if (copy_from_user(cmd, user_mem, len)) {
+    if (copy_from_user(xen_cmd, user_mem + sizeof(*cmd), xen_cmd_len)) {
         ret = -EFAULT;
         goto exit;
     }
 
-    if(cmd->mxom_cmd.cmd != MODXOM_CMD_WRITE_SUBPAGES)
-    goto exit;
-
-    if(!cmd->xen_cmd.num_subpages)
-    goto exit;
+    if (!xen_cmd->num_subpages)
+        goto exit;
 
-    if( cmd->xen_cmd.num_subpages >
-        (len - sizeof(cmd->mxom_cmd) - sizeof(cmd->xen_cmd.num_subpages)) / sizeof(*(cmd->xen_cmd.write_info)))
+    if (xen_cmd->num_subpages > (xen_cmd_len - sizeof(xen_cmd->num_subpages)) / sizeof(*(xen_cmd->write_info)))
         goto exit;
 
-    mutex_lock(&file_lock);
+    down_read(&curr_entry->lock);
+    ret = xom_subpage_write_xen(curr_entry, cmd, operand);
+    up_read(&curr_entry->lock);
+
+exit:
+    put_operand(operand);
+    return ret;
+}
+
+// Get the gfn of the subpage-level XOM page at uaddr
+static int get_subpage_gfn(pxom_process_entry curr_entry, uint64_t uaddr, unsigned long *gfn) {
+    pxom_mapping curr_mapping;
+
+    if (uaddr & (PAGE_SIZE - 1))
+        return -EINVAL;
+
+    curr_mapping = find_mapping(curr_entry, uaddr);
+    if (!curr_mapping || !curr_mapping->subpage_level)
+        return -EINVAL;
+
+    *gfn = mapping_gfn(curr_mapping, (uaddr - curr_mapping->uaddr) >> PAGE_SHIFT);
+    return 0;
+}
+
+/*
+ * Translates the destination addresses of the runs in the first num_pages operand pages to gfns
+ * and hands them to Xen. Each operand page ends at a run with zero subpages or at its end.
+ */
+static int xom_subpage_write_multi_xen(pxom_process_entry curr_entry, pmodxom_operand operand, unsigned int num_pages) {
+    int status;
+    unsigned int page, offset;
+    unsigned long gfn;
+    xom_subpage_write_run *run;
+    struct mmuext_op op = {
+            .cmd = MMUEXT_WRITE_XOM_SPAGES_MULTI,
+            .arg1.mfn = virt_to_phys(operand->pages) >> PAGE_SHIFT,
+            .arg2.nr_ents = num_pages,
+    };
+
+    down_read(&curr_entry->lock);
+
+    for (page = 0; page < num_pages; page++) {
+        offset = 0;
+        while (offset + sizeof(*run) <= PAGE_SIZE) {
+            run = (xom_subpage_write_run *) (operand->pages + page * PAGE_SIZE + offset);
+            if (!run->num_subpages)
+                break;
+            status = get_subpage_gfn(curr_entry, run->dest_addr, &gfn);
+            if (status < 0)
+                goto exit;
+            run->dest_addr = gfn;
+            offset += sizeof(*run) + run->num_subpages * sizeof(xom_subpage_write_info);
+        }
+    }
+
+    status = hypercall(&op, 1, NULL, DOMID_SELF);
+    if (status) {
+#ifdef MODXOM_DEBUG
+        printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
+#endif
+        status = -EINVAL;
+    }
+
+exit:
+    up_read(&curr_entry->lock);
+    return status;
+}
+
+/*
+ * Writes subpages into many destination pages. The runs are copied straight from user memory and
+ * packed into the operand pages, so that Xen can process up to MODXOM_OPERAND_PAGES pages of runs
+ * per hypercall. The process lock is only held while the runs are translated and submitted.
+ */
+static ssize_t xom_write_into_subpages_multi(pxom_process_entry curr_entry, pmodxom_cmd cmd,
+                                             const char __user *user_mem, size_t len) {
+    ssize_t ret = -EINVAL;
+    pmodxom_operand operand;
+    xom_subpage_write_run header, *run;
+    unsigned int i, run_size, dest_page = 0, dest_offset = 0;
+    size_t offset = sizeof(*cmd);
+
+    operand = get_operand();
+
+    for (i = 0; i < cmd->num_pages; i++) {
+        if (offset + sizeof(header) > len)
+            goto exit;
+        if (copy_from_user(&header, user_mem + offset, sizeof(header))) {
+            ret = -EFAULT;
+            goto exit;
+        }
+        if (!header.num_subpages || header.num_subpages > MAX_SUBPAGES_PER_RUN)
+            goto exit;
+        run_size = sizeof(header) + header.num_subpages * sizeof(xom_subpage_write_info);
+        if (offset + run_size > len)
+            goto exit;
+
+        // Terminate the current operand page if the run does not fit anymore
+        if (dest_offset + run_size > PAGE_SIZE) {
+            if (dest_offset + sizeof(*run) <= PAGE_SIZE)
+                memset(operand->pages + dest_page * PAGE_SIZE + dest_offset, 0, sizeof(*run));
+            dest_offset = 0;
+            if (++dest_page == MODXOM_OPERAND_PAGES) {
+                ret = xom_subpage_write_multi_xen(curr_entry, operand, dest_page);
+                if (ret < 0)
+                    goto exit;
+                ret = -EINVAL;
+                dest_page = 0;
+            }
+        }
+
+        run = (xom_subpage_write_run *) (operand->pages + dest_page * PAGE_SIZE + dest_offset);
+        *run = header;
+        if (copy_from_user(run + 1, user_mem + offset + sizeof(header), run_size - sizeof(header))) {
+            ret = -EFAULT;
+            goto exit;
+        }
+
+        dest_offset += run_size;
+        offset += run_size;
+    }
 
-    memcpy(modxom_src_operand_page, &cmd->xen_cmd, len - sizeof(cmd->mxom_cmd));
-    ret = xom_subpage_write_xen(&cmd->mxom_cmd);
+    if (!dest_offset)
+        goto exit;
+    if (dest_offset + sizeof(*run) <= PAGE_SIZE)
+        memset(operand->pages + dest_page * PAGE_SIZE + dest_offset, 0, sizeof(*run));
+    ret = xom_subpage_write_multi_xen(curr_entry, operand, dest_page + 1);
 
-    mutex_unlock(&file_lock);
 exit:
-    if(cmd)
-        kvfree(cmd);
+    put_operand(operand);
     return ret;
 }
 
-// Make sure that base_addr is a XOM page, and then forward call to hypervisor
-static int xom_forward_to_hypervisor(uint64_t base_addr, unsigned int mmuext_t_cmd, unsigned int mmuext_t_arg2) {
-    unsigned page_index;
+// Scrub and unlock the subpages in cmd->num_pages, which is a bitmask, of the page at cmd->base_addr
+static int xom_free_subpages(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
     int status;
+    unsigned long gfn;
     struct mmuext_op op;
-    pxom_process_entry curr_entry;
+
+    status = get_subpage_gfn(curr_entry, cmd->base_addr, &gfn);
+    if (status < 0)
+        return status;
+
+    op.cmd = MMUEXT_FREE_XOM_SPAGES;
+    op.arg1.mfn = gfn;
+    op.arg2.nr_ents = cmd->num_pages;
+    status = hypercall(&op, 1, NULL, DOMID_SELF);
+    if (status) {
+#ifdef MODXOM_DEBUG
+        printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
+#endif
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Make sure that base_addr is a XOM page, and then forward call to hypervisor
+/*
+ * Marks a range of pages of one mapping for register clearing. Xen takes one page per op, so the
+ * ops for the whole range are submitted with a single hypercall, which Xen continues transparently
+ * if it is preempted. The low byte of num_pages is the register-clear descriptor, the bits above
+ * REG_CLEAR_PAGES_SHIFT the number of pages, where 0 means a single page.
+ * Returns the number of marked pages, which is short of the range if Xen failed partway through.
+ */
+static int xom_mark_reg_clear(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
+    int status;
+    struct mmuext_op *ops;
     pxom_mapping curr_mapping;
+    unsigned int i, page_index, done = 0;
+    unsigned int reg_clear_desc = cmd->num_pages & REG_CLEAR_DESC_MASK;
+    unsigned int num_pages = max(cmd->num_pages >> REG_CLEAR_PAGES_SHIFT, 1u);
 
     // Must be page-aligned
-    if ((uintptr_t) base_addr & ((1 << PAGE_SHIFT) - 1))
+    if ((uintptr_t) cmd->base_addr & ((1 << PAGE_SHIFT) - 1))
         return -EINVAL;
-    curr_entry = get_process_entry();
-    if (!curr_entry)
-        return -EBADF;
 
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *) curr_mapping != &(curr_entry->mappings)) {
-        if (base_addr < curr_mapping->uaddr ||
-            base_addr >= curr_mapping->uaddr + curr_mapping->num_pages * PAGE_SIZE) {
-            curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-            continue;
-        }
+    curr_mapping = find_mapping(curr_entry, cmd->base_addr);
+    if (!curr_mapping)
+        return -EINVAL;
 
-        page_index = (base_addr - curr_mapping->uaddr) / PAGE_SIZE;
+    page_index = (cmd->base_addr - curr_mapping->uaddr) >> PAGE_SHIFT;
+    if (num_pages > curr_mapping->num_pages - page_index)
+        return -EINVAL;
+
+    ops = kvmalloc_array(num_pages, sizeof(*ops), GFP_KERNEL);
+    if (!ops)
+        return -ENOMEM;
 
-        op.cmd = mmuext_t_cmd;
-        op.arg1.mfn =
-                virt_to_phys((void *) (curr_mapping->kaddr + (base_addr - curr_mapping->uaddr))) >> PAGE_SHIFT;
-        op.arg2.nr_ents = mmuext_t_arg2;
+    for (i = 0; i < num_pages; i++) {
+        ops[i] = (struct mmuext_op) {
+                .cmd = MMUEXT_MARK_REG_CLEAR,
+                .arg1.mfn = mapping_gfn(curr_mapping, page_index + i),
+                .arg2.nr_ents = reg_clear_desc
+        };
+    }
 #ifdef MODXOM_DEBUG
-        printk(KERN_INFO "[MODXOM] Invoking mmuext_op with dest_mfn 0x%lx\n", op.arg1.mfn);
+    printk(KERN_INFO "[MODXOM] Marking %u pages for register clearing, starting at mfn 0x%lx\n", num_pages, ops[0].arg1.mfn);
 #endif
-        status = hypercall(&op, 1, NULL, DOMID_SELF);
-        if (status) {
+    status = hypercall(ops, num_pages, &done, DOMID_SELF);
+    kvfree(ops);
+    if (status) {
 #ifdef MODXOM_DEBUG
-            printk(KERN_INFO "[MODXOM] Failed - Status 0x%x\n", status);
+        printk(KERN_INFO "[MODXOM] Failed after %u pages - Status 0x%x\n", done, status);
 #endif
-            return -EINVAL;
-        }
-        return 0;
+        // The first done pages stay marked, the caller has to know about them
+        return done ? (int) done : -EINVAL;
     }
-    return -EINVAL;
+    return (int) num_pages;
 }
 
-static int xom_open(struct inode *__attribute__((unused)) _inode, struct file *__attribute__((unused)) _file) {
+static int xom_open(struct inode *__attribute__((unused)) _inode, struct file *f) {
     pxom_process_entry new_entry;
 
-    mutex_lock(&file_lock);
-    if (get_process_entry()) {
-        mutex_unlock(&file_lock);
-        return -EEXIST;
-    }
+    if (!current->mm)
+        return -EINVAL;
+
     new_entry = kmalloc(sizeof(*new_entry), GFP_KERNEL);
-    new_entry->pid = current->pid;
-    INIT_LIST_HEAD(&(new_entry->mappings));
-    list_add(&(new_entry->lhead), &xom_entries);
-    mutex_unlock(&file_lock);
+    if (!new_entry)
+        return -ENOMEM;
+
+    init_rwsem(&new_entry->lock);
+    new_entry->mappings = RB_ROOT_CACHED;
+    new_entry->mm = current->mm;
+    mmgrab(new_entry->mm);
+    f->private_data = new_entry;
     return 0;
 }
 
-static int xom_release(struct inode *, struct file *) {
+static int xom_release(struct inode *__attribute__((unused)) _inode, struct file *f) {
     int status;
-    pxom_process_entry curr_entry;
+    pxom_process_entry curr_entry = f->private_data;
 
-    mutex_lock(&file_lock);
-    curr_entry = get_process_entry();
-    if (!curr_entry) {
-        mutex_unlock(&file_lock);
+    if (!curr_entry)
         return 0;
-    }
+
+    // This is the last reference to the file, so nobody else can use the entry anymore
     status = release_process(curr_entry);
-    list_del(&(curr_entry->lhead));
+    mmdrop(curr_entry->mm);
     kfree(curr_entry);
-    mutex_unlock(&file_lock);
+    f->private_data = NULL;
 
     return status;
 }
 
+// Called with mmap_lock held
 static int xom_mmap(struct file *f, struct vm_area_struct *vma) {
-    int status = -EBADF;
+    int status;
     pxom_process_entry curr_entry;
     pxom_mapping new_mapping;
 
@@ -582,26 +984,35 @@ static int xom_mmap(struct file *f, struct vm_area_struct *vma) {
     if (!xen_hvm_domain())
         return -ENODEV;
 
-    mutex_lock(&file_lock);
+    // Private pfn mappings would be copy-on-write, and cannot be mapped in more than one run
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
 
-    curr_entry = get_process_entry();
+    curr_entry = get_process_entry(f);
+    if (!curr_entry || vma->vm_mm != curr_entry->mm)
+        return -EBADF;
 
-    if (!curr_entry)
-        goto exit;
+    down_write(&curr_entry->lock);
 
     status = manage_mapping_intersection(vma, curr_entry);
     if (status < 0)
         goto exit;
 
-    new_mapping = get_new_mapping(vma, curr_entry);
+    new_mapping = get_new_mapping(vma);
 
-    if (!new_mapping)
+    if (!new_mapping) {
         status = -EINVAL;
-    else
-        list_add(&(new_mapping->lhead), &(curr_entry->mappings));
+    } else {
+        interval_tree_insert(&new_mapping->it, &curr_entry->mappings);
+        // The VMA holds a reference of its own next to the one of the tree, and one on the module
+        kref_get(&new_mapping->refs);
+        __module_get(THIS_MODULE);
+        vma->vm_private_data = new_mapping;
+        vma->vm_ops = &xom_vm_ops;
+    }
 
 exit:
-    mutex_unlock(&file_lock);
+    up_write(&curr_entry->lock);
 
 #ifdef MODXOM_DEBUG
     printk(KERN_INFO "[MODXOM] xom_mmap returns %d\n", status);
@@ -610,30 +1021,28 @@ exit:
     return status;
 }
 
+// mmap_lock is taken before the process lock, as in xom_mmap, and both are dropped before copying to user memory
 static ssize_t xom_read(struct file *f, char __user *user_mem, size_t len, loff_t *offset) {
-    ssize_t status = -EBADF;
+    ssize_t status = 0;
     size_t len_reqired = sizeof(READ_HEADER_STRING), index, clen;
-    char *dstring;
+    char *dstring = NULL;
     pxom_process_entry curr_entry;
     pxom_mapping curr_mapping;
+    struct rb_node *node;
     struct vm_area_struct *vma;
 
-    mutex_lock(&file_lock);
-
-    curr_entry = get_process_entry();
+    curr_entry = get_process_entry(f);
     if(!curr_entry)
-        goto exit;
+        return -EBADF;
+
+    mmap_read_lock(curr_entry->mm);
+    down_read(&curr_entry->lock);
 
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
-    while ((void *)curr_mapping != &(curr_entry->mappings)) {
+    for (node = rb_first_cached(&curr_entry->mappings); node; node = rb_next(node))
         len_reqired += MAPPING_LINE_SIZE;
-        curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
-    }
 
-    if (*offset >= len_reqired){
-        status = 0;
+    if (*offset >= len_reqired)
         goto exit;
-    }
 
     dstring = kvmalloc(len_reqired, GFP_KERNEL);
     if (!dstring){
@@ -642,77 +1051,154 @@ static ssize_t xom_read(struct file *f, char __user *user_mem, size_t len, loff_
     }
 
     memcpy(dstring, READ_HEADER_STRING, sizeof(READ_HEADER_STRING));
-    curr_mapping = (pxom_mapping) curr_entry->mappings.next;
     index = sizeof(READ_HEADER_STRING) - 1;
-    while ((void *)curr_mapping != &(curr_entry->mappings) && index < len_reqired) {
-        vma = find_vma(current->mm, curr_mapping->uaddr);
-        if (!vma) {
-            curr_mapping = (pxom_mapping)
-            curr_mapping->lhead.next;
+    for (node = rb_first_cached(&curr_entry->mappings); node && index < len_reqired; node = rb_next(node)) {
+        curr_mapping = rb_entry(node, xom_mapping, it.rb);
+        vma = find_vma(curr_entry->mm, curr_mapping->uaddr);
+        if (!vma)
             continue;
-        }
-        index += snprintf(dstring + index, len_reqired - index, "%16lx, %16lx\n",
-        vma->vm_start, vma->vm_end - vma->vm_start);
-        curr_mapping = (pxom_mapping) curr_mapping->lhead.next;
+        index += snprintf(dstring + index, len_reqired - index, "%16lx, %16lx, %11u\n",
+        vma->vm_start, vma->vm_end - vma->vm_start, curr_mapping->hypercalls);
     }
 
+exit:
+    up_read(&curr_entry->lock);
+    mmap_read_unlock(curr_entry->mm);
+
+    if (!dstring)
+        return status;
+
     clen = MIN(len_reqired - (unsigned long) *offset, len);
     if ( copy_to_user(user_mem, dstring + *offset, clen))
         clen = 0;
     *offset += clen;
     kvfree(dstring);
 
-    status = (ssize_t) clen;
-exit:
-    mutex_unlock(&file_lock);
-    return status;
+    return (ssize_t) clen;
 }
 
-static ssize_t xom_write(struct file *f, const char __user *user_mem, size_t len, loff_t *offset) {
+// Commands that change the state of a mapping need exclusive access, the others only look mappings up
+static bool modifies_mappings(uint32_t cmd) {
+    switch (cmd) {
+        case MODXOM_CMD_LOCK:
+        case MODXOM_CMD_INIT_SUBPAGES:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Executes a single command that consists of just the modxom_cmd
+static ssize_t xom_execute_cmd(pxom_process_entry curr_entry, pmodxom_cmd cmd) {
     ssize_t ret = -EINVAL;
-    modxom_cmd cmd;
+    bool exclusive;
 
     #ifdef MODXOM_DEBUG
-    printk(KERN_INFO "[MODXOM] xom_write(user_mem: 0x%lx, len: 0x%lx, offset: %llx), PID: %d\n",
-        (unsigned long) user_mem, len, *offset, current->pid);
+    printk(KERN_INFO "[MODXOM] CMD: cmd: %s, base_addr: 0x%lx, num_pages: %u\n",
+        cmd->cmd == MODXOM_CMD_FREE ? "MODXOM_CMD_FREE" :
+        cmd->cmd == MODXOM_CMD_LOCK ? "MODXOM_CMD_LOCK" :
+        cmd->cmd == MODXOM_CMD_INIT_SUBPAGES ? "MODXOM_CMD_INIT_SUBPAGES" : "<unknown>",
+        cmd->base_addr, cmd->num_pages);
     #endif
 
-    if(len < sizeof(modxom_cmd))
-        return -EINVAL;
-    if(len > sizeof(modxom_cmd))
-        return xom_write_into_subpages(f, user_mem, len, offset);
-    if(copy_from_user(&cmd, user_mem, sizeof(cmd)))
-        return -EFAULT;
+    // Freeing unmaps memory, which xmem_free does without holding the process lock
+    if (cmd->cmd == MODXOM_CMD_FREE)
+        return xmem_free(curr_entry, cmd);
 
-    #ifdef MODXOM_DEBUG
-    printk(KERN_INFO "[MODXOM] CMD: cmd: %s, base_addr: 0x%lx, num_pages: %u\n",
-        cmd.cmd == MODXOM_CMD_FREE ? "MODXOM_CMD_FREE" :
-        cmd.cmd == MODXOM_CMD_LOCK ? "MODXOM_CMD_LOCK" :
-        cmd.cmd == MODXOM_CMD_INIT_SUBPAGES ? "MODXOM_CMD_INIT_SUBPAGES" : "<unknown>",
-        cmd.base_addr, cmd.num_pages);
-    #endif
+    exclusive = modifies_mappings(cmd->cmd);
+    if (exclusive)
+        down_write(&curr_entry->lock);
+    else
+        down_read(&curr_entry->lock);
 
-    mutex_lock(&file_lock);
-    switch(cmd.cmd){
+    switch(cmd->cmd){
         case MODXOM_CMD_NOP:
-            ret = sizeof(cmd);
-            break;
-        case MODXOM_CMD_FREE:
-            ret = xmem_free(&cmd);
+            ret = sizeof(*cmd);
             break;
         case MODXOM_CMD_LOCK:
-            ret = lock_pages(&cmd);
+            ret = lock_pages(curr_entry, cmd);
             break;
         case MODXOM_CMD_INIT_SUBPAGES:
-            ret = xom_init_subpages(&cmd);
+            ret = xom_init_subpages(curr_entry, cmd);
             break;
         case MODXOM_CMD_MARK_REG_CLEAR:
-            ret = xom_forward_to_hypervisor(cmd.base_addr, MMUEXT_MARK_REG_CLEAR, cmd.num_pages);
+            ret = xom_mark_reg_clear(curr_entry, cmd);
+            break;
+        case MODXOM_CMD_FREE_SUBPAGES:
+            ret = xom_free_subpages(curr_entry, cmd);
             break;
         default:;
     }
 
-    mutex_unlock(&file_lock);
+    if (exclusive)
+        up_write(&curr_entry->lock);
+    else
+        up_read(&curr_entry->lock);
+    return ret;
+}
+
+/*
+ * Executes the commands that follow a MODXOM_CMD_VECTOR header in order, and stops at the first one
+ * that fails. If the header's base_addr is set, it points to one int32_t per command, which receives
+ * the command's result, or -ECANCELED if the command was skipped.
+ */
+static ssize_t
+xom_write_vector(pxom_process_entry curr_entry, pmodxom_cmd cmd, const char __user *user_mem, size_t len) {
+    ssize_t ret = 0, cmd_ret;
+    int32_t __user *results = (int32_t __user *) (uintptr_t) cmd->base_addr;
+    modxom_cmd vector_cmd;
+    unsigned int i;
+
+    if (len != (cmd->num_pages + 1ul) * sizeof(*cmd))
+        return -EINVAL;
+
+    for (i = 0; i < cmd->num_pages; i++) {
+        if (ret < 0 && !results)
+            break;
+        if (ret < 0)
+            cmd_ret = -ECANCELED;
+        else if (copy_from_user(&vector_cmd, user_mem + (i + 1) * sizeof(vector_cmd), sizeof(vector_cmd)))
+            cmd_ret = -EFAULT;
+        else
+            cmd_ret = xom_execute_cmd(curr_entry, &vector_cmd);
+
+        if (ret >= 0 && cmd_ret < 0)
+            ret = cmd_ret;
+        if (results && put_user((int32_t) cmd_ret, results + i))
+            return -EFAULT;
+    }
+
+    return ret;
+}
+
+static ssize_t xom_write(struct file *f, const char __user *user_mem, size_t len, loff_t *offset) {
+    ssize_t ret;
+    modxom_cmd cmd;
+    pxom_process_entry curr_entry;
+
+    #ifdef MODXOM_DEBUG
+    printk(KERN_INFO "[MODXOM] xom_write(user_mem: 0x%lx, len: 0x%lx, offset: %llx), PID: %d\n",
+        (unsigned long) user_mem, len, *offset, current->pid);
+    #endif
+
+    if(len < sizeof(modxom_cmd))
+        return -EINVAL;
+    if(copy_from_user(&cmd, user_mem, sizeof(cmd)))
+        return -EFAULT;
+
+    curr_entry = get_process_entry(f);
+    if (!curr_entry)
+        return -EBADF;
+
+    if (cmd.cmd == MODXOM_CMD_VECTOR)
+        ret = xom_write_vector(curr_entry, &cmd, user_mem, len);
+    else if (len == sizeof(modxom_cmd))
+        ret = xom_execute_cmd(curr_entry, &cmd);
+    else if (cmd.cmd == MODXOM_CMD_WRITE_SUBPAGES_MULTI)
+        ret = xom_write_into_subpages_multi(curr_entry, &cmd, user_mem, len);
+    else
+        ret = xom_write_into_subpages(curr_entry, &cmd, user_mem, len);
+
     #ifdef MODXOM_DEBUG
     printk(KERN_INFO "[MODXOM] xom_write returns %li\n", ret);
     #endif
@@ -727,11 +1213,51 @@ static const struct proc_ops file_ops = {
         .proc_mmap = xom_mmap
 };
 
+static void free_operands(void) {
+    pmodxom_operand operand;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        operand = per_cpu_ptr(&modxom_operands, cpu);
+        if (operand->pages)
+            free_pages((unsigned long) operand->pages, get_order(MODXOM_OPERAND_PAGES * PAGE_SIZE));
+        operand->pages = NULL;
+    }
+}
+
 static int __init
 modxom_init(void) {
     struct proc_dir_entry *entry;
-    mutex_init(&file_lock);
-    modxom_src_operand_page = (uint8_t *) __get_free_pages(GFP_KERNEL, get_order(PAGE_SIZE));
+    pmodxom_operand operand;
+    xom_node_reserves *reserves;
+    struct page *page;
+    unsigned int cpu;
+    int nid;
+
+    reserves = kcalloc(nr_node_ids, sizeof(*reserves), GFP_KERNEL);
+    if (!reserves)
+        return -ENOMEM;
+    for (nid = 0; nid < nr_node_ids; nid++) {
+        init_reserve(&reserves[nid].blocks, MAPPING_BLOCK_ORDER, &reserve_blocks);
+        init_reserve(&reserves[nid].pages, 0, &reserve_pages);
+    }
+
+    for_each_possible_cpu(cpu) {
+        operand = per_cpu_ptr(&modxom_operands, cpu);
+        mutex_init(&operand->lock);
+        // Operand pages are only touched by their own CPU
+        page = alloc_pages_node(cpu_to_mem(cpu), GFP_KERNEL, get_order(MODXOM_OPERAND_PAGES * PAGE_SIZE));
+        operand->pages = page ? page_address(page) : NULL;
+        if (!operand->pages) {
+            free_operands();
+            kfree(reserves);
+            return -ENOMEM;
+        }
+    }
+
+    node_reserves = reserves;
+    schedule_work(&refill_work);
+
     entry = proc_create(MODXOM_PROC_FILE_NAME, 0666, NULL, &file_ops);
     if (xen_hvm_domain())
         printk(KERN_INFO
@@ -745,17 +1271,17 @@ modxom_init(void) {
 static void __exit
 
 modxom_exit(void) {
-    pxom_process_entry curr_entry = (pxom_process_entry) xom_entries.next, last_entry;
-    while ((void *) curr_entry != &xom_entries) {
-        release_process(curr_entry);
-        last_entry = curr_entry;
-        curr_entry = (pxom_process_entry) curr_entry->lhead.next;
-        kfree(last_entry);
-    }
+    int nid;
 
+    // Releases the state of every process that still has the file open. No XOM VMA is left, as each pins the module
     remove_proc_entry(MODXOM_PROC_FILE_NAME, NULL);
-    free_pages((unsigned long) modxom_src_operand_page, get_order(PAGE_SIZE));
-    mutex_destroy(&file_lock);
+    cancel_work_sync(&refill_work);
+    for (nid = 0; nid < nr_node_ids; nid++) {
+        drain_reserve(&node_reserves[nid].blocks);
+        drain_reserve(&node_reserves[nid].pages);
+    }
+    kfree(node_reserves);
+    free_operands();
     printk(KERN_INFO
     "[MODXOM] MODXOM Kernel Module unloaded\n");
 }
@@ -18,16 +18,39 @@
 #define MODXOM_CMD_WRITE_SUBPAGES   4
 #define MODXOM_CMD_GET_SECRET_PAGE  5
 #define MODXOM_CMD_MARK_REG_CLEAR   6
+#define MODXOM_CMD_WRITE_SUBPAGES_MULTI 7
+#define MODXOM_CMD_FREE_SUBPAGES    8
+#define MODXOM_CMD_VECTOR           9
 
 #define REG_CLEAR_TYPE_NONE     0
 #define REG_CLEAR_TYPE_VECTOR   1
 #define REG_CLEAR_TYPE_FULL     2
 
+// MODXOM_CMD_MARK_REG_CLEAR may add the widest vector registers used by the page to the type
+#define REG_CLEAR_WIDTH_MASK    0x30
+#define REG_CLEAR_WIDTH_WIDEST  0x00
+#define REG_CLEAR_WIDTH_SSE     0x10
+#define REG_CLEAR_WIDTH_AVX     0x20
+#define REG_CLEAR_WIDTH_AVX512  0x30
+
+/*
+ * The num_pages field of MODXOM_CMD_MARK_REG_CLEAR holds the register-clear descriptor in its low
+ * byte, and the number of pages to mark from base_addr on above it. 0 pages means a single page.
+ * The command returns the number of pages that were marked. Xen cannot mark a page twice, so a
+ * count below the requested one tells the caller which pages are marked after a partial failure.
+ */
+#define REG_CLEAR_DESC_MASK     0xff
+#define REG_CLEAR_PAGES_SHIFT   8
+
 #ifndef SUBPAGE_SIZE
 #define SUBPAGE_SIZE (PAGE_SIZE / (sizeof(uint32_t) << 3))
 #endif
 
 #define MAX_SUBPAGES_PER_CMD ((PAGE_SIZE - sizeof(uint8_t)) / (sizeof(xom_subpage_write_info)))
+#define MAX_SUBPAGES_PER_RUN ((PAGE_SIZE - sizeof(xom_subpage_write_run)) / (sizeof(xom_subpage_write_info)))
+
+// Mappings of at least this size are 2MB-aligned in guest-physical memory and sealed with 2MB EPT entries
+#define XOM_SUPERPAGE_SIZE (PAGE_SIZE << 9)
 
 #define MODXOM_PROC_FILE_NAME   "xom"
 #define XOM_FILE                ("/proc/" MODXOM_PROC_FILE_NAME)
@@ -36,6 +59,11 @@
 extern "C" {
 #endif
 
+/*
+ * MODXOM_CMD_VECTOR is a modxom_cmd with num_pages set to the number of commands, followed by
+ * that many single modxom_cmd commands, which are executed in order until one fails. If base_addr
+ * is not 0, it points to one int32_t per command that receives the command's result.
+ */
 typedef struct {
     uint32_t cmd;
     uint32_t num_pages;
@@ -57,6 +85,17 @@ typedef struct {
     xom_subpage_write_command xen_cmd;
 } xom_subpage_write;
 
+/*
+ * MODXOM_CMD_WRITE_SUBPAGES_MULTI is a modxom_cmd with num_pages set to the number of runs,
+ * followed by the runs. Each run is this header, followed by num_subpages (at most
+ * MAX_SUBPAGES_PER_RUN) xom_subpage_write_info entries for the page at dest_addr.
+ */
+typedef struct {
+    uint64_t dest_addr;
+    uint8_t num_subpages;
+    uint8_t reserved[7];
+} xom_subpage_write_run;
+
 
 #ifdef __cplusplus
 }
@@ -183,7 +183,8 @@ extern int (*const printf_d)(const char *__restrict format, ...);
 
 #define printf(...) if (xom_provider_debug_prints) printf_d(__VA_ARGS__);
 
-void *subpage_pool_lock_into_xom(const unsigned char *data, size_t size);
+// footprint is the register footprint of the code in data, see xom_mark_register_clear
+void *subpage_pool_lock_into_xom(const unsigned char *data, size_t size, unsigned char footprint);
 
 void subpage_pool_free(void *data);
 
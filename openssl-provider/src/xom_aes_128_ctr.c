@@ -104,7 +104,8 @@ int aes_128_ctr_init(void *vctx, const unsigned char *key, size_t keylen, const
     for (i = 0; i < sizeof(ctx->ctr.d); i++)
         ctx->ctr.b[i] = ctx->iv[(sizeof(ctx->iv) - 1) - i];
 
-    ctx->aes_fun = subpage_pool_lock_into_xom(staging_buffer, ctx->has_vaes ? vaes_size : aesni_size);
+    ctx->aes_fun = subpage_pool_lock_into_xom(staging_buffer, ctx->has_vaes ? vaes_size : aesni_size,
+                                              ctx->has_vaes ? XOM_REG_CLEAR_AVX : XOM_REG_CLEAR_SSE);
 
     free(staging_buffer);
     if(!ctx->aes_fun)
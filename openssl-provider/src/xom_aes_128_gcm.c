@@ -213,7 +213,8 @@ int aes_128_gcm_einit(void *vctx, const unsigned char *key, size_t keylen, const
         return 1;
 
     if(ctx->staging_buffer) {
-        ctx->aes_fun = subpage_pool_lock_into_xom(ctx->staging_buffer, ctx->has_vaes ? vaes_size : aesni_size);
+        ctx->aes_fun = subpage_pool_lock_into_xom(ctx->staging_buffer, ctx->has_vaes ? vaes_size : aesni_size,
+                                                  ctx->has_vaes ? XOM_REG_CLEAR_AVX : XOM_REG_CLEAR_SSE);
         free(ctx->staging_buffer);
         ctx->staging_buffer = NULL;
     }
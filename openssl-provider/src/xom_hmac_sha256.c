@@ -174,7 +174,8 @@ static int hmac_init(void *vctx, const unsigned char *key, size_t keylen, const
     xom_lock(ctx->xbuf);
     ctx->locked = 1;
     if(get_xom_mode() == XOM_MODE_SLAT && !ctx->marked) {
-        if(xom_mark_register_clear(ctx->xbuf, 0, 0))
+        // The SHA-256 kernel uses %ymm registers, but no AVX-512 state
+        if(xom_mark_register_clear(ctx->xbuf, XOM_REG_CLEAR_AVX, 0))
             return 0;
         ctx->marked = 1;
     }
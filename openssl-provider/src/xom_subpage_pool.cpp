@@ -1,44 +1,66 @@
 #include <cstdlib>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include "aes_xom.h"
 
-#include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <vector>
 
 #define countof(x) (sizeof(x)/sizeof(*(x)))
 #define page_addr(x) ((unsigned long)(x) & ~(PAGE_SIZE - 1))
-#define bytes_to_subpages(x) (((x) / SUBPAGE_SIZE) + (((x) & (SUBPAGE_SIZE-1)) ? SUBPAGE_SIZE : 0))
+#define bytes_to_subpages(x) (((x) / SUBPAGE_SIZE) + (((x) & (SUBPAGE_SIZE-1)) ? 1 : 0))
 #define POOL_BUFFER_SIZE (PAGE_SIZE << 4)
-#define POOL_FREE_THRESHOLD ((POOL_BUFFER_SIZE / SUBPAGE_SIZE) * 4 / 5)
 
 struct subpage_list_entry {
     struct xom_subpages* subpages;
     size_t last_page_marked;
     size_t subpages_used;
-    std::unordered_set<uintptr_t> buffers_used;
-
-    subpage_list_entry() : subpages(nullptr), last_page_marked(0), subpages_used(0), buffers_used(std::unordered_set<uintptr_t>()) {}
-    explicit subpage_list_entry(struct xom_subpages* subpages) : subpages(subpages), last_page_marked(0), subpages_used(0), buffers_used(std::unordered_set<uintptr_t>()) {}
+    // All code in a pool buffer shares one register footprint, so that its pages are marked correctly
+    unsigned char footprint;
+    // NUMA node whose memory backs the buffer
+    unsigned int node;
+    // Maps each buffer in use to the number of subpages it occupies
+    std::unordered_map<uintptr_t, size_t> buffers_used;
+
+    subpage_list_entry() : subpages(nullptr), last_page_marked(0), subpages_used(0), footprint(0), node(0), buffers_used(std::unordered_map<uintptr_t, size_t>()) {}
+    subpage_list_entry(struct xom_subpages* subpages, unsigned char footprint, unsigned int node) : subpages(subpages), last_page_marked(0), subpages_used(0), footprint(footprint), node(node), buffers_used(std::unordered_map<uintptr_t, size_t>()) {}
 };
 
 static std::vector<subpage_list_entry> subpage_pool;
 
+// Pool buffers are backed by memory of the node they were allocated on, so each node gets its own buffers
+static unsigned int current_node() {
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) < 0)
+        return 0;
+    return node;
+}
+
 static void update_entry(subpage_list_entry& curr_entry, size_t size, const void* ret) {
+    // Allocations may span several pages, every one of them needs to be marked
+    const unsigned long last_page = page_addr((const unsigned char*)ret + size - 1);
+    unsigned long page = std::max(page_addr(ret), curr_entry.last_page_marked + PAGE_SIZE);
+
     curr_entry.subpages_used += bytes_to_subpages(size);
 
-    if (get_xom_mode() == XOM_MODE_SLAT && curr_entry.last_page_marked < page_addr(ret) ) {
-        xom_mark_register_clear_subpage(curr_entry.subpages, 0, ((unsigned char*)ret - *((unsigned char**) curr_entry.subpages)) / PAGE_SIZE);
-        curr_entry.last_page_marked = page_addr(ret);
+    for (; get_xom_mode() == XOM_MODE_SLAT && page <= last_page; page += PAGE_SIZE) {
+        xom_mark_register_clear_subpage(curr_entry.subpages, curr_entry.footprint, (page - page_addr(*((unsigned char**) curr_entry.subpages))) / PAGE_SIZE);
+        curr_entry.last_page_marked = page;
     }
 
-    curr_entry.buffers_used.emplace(reinterpret_cast<uintptr_t>(ret));
+    curr_entry.buffers_used.emplace(reinterpret_cast<uintptr_t>(ret), bytes_to_subpages(size));
 }
 
-extern "C" void* subpage_pool_lock_into_xom (const unsigned char* data, size_t size) {
+extern "C" void* subpage_pool_lock_into_xom (const unsigned char* data, size_t size, unsigned char footprint) {
     void* ret;
     struct xom_subpages *new_subpages;
+    const unsigned int node = current_node();
 
     for (auto curr_entry = subpage_pool.rbegin(); curr_entry != subpage_pool.rend(); curr_entry++) {
+        if (curr_entry->footprint != footprint || curr_entry->node != node)
+            continue;
 
         if((POOL_BUFFER_SIZE / SUBPAGE_SIZE) - curr_entry->subpages_used < bytes_to_subpages(size))
             continue;
@@ -53,7 +75,7 @@ extern "C" void* subpage_pool_lock_into_xom (const unsigned char* data, size_t s
     new_subpages = xom_alloc_subpages(POOL_BUFFER_SIZE);
     if (!new_subpages)
         return nullptr;
-    auto curr_entry = subpage_list_entry(new_subpages);
+    auto curr_entry = subpage_list_entry(new_subpages, footprint, node);
     ret = xom_fill_and_lock_subpages(curr_entry.subpages, size, data);
     if(ret) {
         update_entry(curr_entry, size, ret);
@@ -71,14 +93,17 @@ extern "C" void subpage_pool_free(void* const data) {
 
     auto it = std::find_if(subpage_pool.begin(), subpage_pool.end(),
                            [data] (const subpage_list_entry& e) -> bool {
-        return e.buffers_used.find(reinterpret_cast<uintptr_t>(data)) == e.buffers_used.end();
+        return e.buffers_used.find(reinterpret_cast<uintptr_t>(data)) != e.buffers_used.end();
     });
 
     if (it == subpage_pool.end())
         return;
 
-    it->buffers_used.erase(reinterpret_cast<uintptr_t>(data));
-    if (xom_free_subpages(it->subpages, data) == 1 && it->subpages_used >= POOL_FREE_THRESHOLD)
+    // Freed subpages are scrubbed and unlocked by libxom, so they can be handed out again
+    auto buffer = it->buffers_used.find(reinterpret_cast<uintptr_t>(data));
+    it->subpages_used -= buffer->second;
+    it->buffers_used.erase(buffer);
+    if (xom_free_subpages(it->subpages, data) == 1)
         subpage_pool.erase(it);
 }
 
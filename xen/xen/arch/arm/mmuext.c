@@ -7,21 +7,51 @@
 
 #include <xen/errno.h>
 #include <xen/guest_access.h>
+#include <xen/sched.h>
 #include <xen/xom_seal.h>
 
 #include <asm/current.h>
 
 #include <public/xen.h>
 
+/* Marks the count of a continuation, like MMU_UPDATE_PREEMPTED on x86. */
+#define MMUEXT_PREEMPTED (~(~0U >> 1))
+
 long do_mmuext_op(XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops,
                   unsigned int count,
                   XEN_GUEST_HANDLE_PARAM(uint) pdone,
                   unsigned int foreigndom)
 {
+    unsigned int i, done = 0;
+    long rc;
+
+    if ( unlikely(count & MMUEXT_PREEMPTED) )
+    {
+        count &= ~MMUEXT_PREEMPTED;
+        if ( unlikely(!guest_handle_is_null(pdone)) )
+            (void)copy_from_guest(&done, pdone, 1);
+    }
+
     if ( unlikely(!guest_handle_okay(uops, count)) )
         return -EFAULT;
 
     /* On ARM we only support XOM seal operations; handle_xom_seal
      * returns -EOPNOTSUPP for any other mmuext cmd. */
-    return handle_xom_seal(current, uops, count, pdone);
+    rc = handle_xom_seal(current, uops, count, &i);
+    if ( rc == -ERESTART )
+    {
+        guest_handle_add_offset(uops, i);
+        rc = hypercall_create_continuation(
+            __HYPERVISOR_mmuext_op, "hihi",
+            uops, (count - i) | MMUEXT_PREEMPTED, pdone, foreigndom);
+    }
+
+    /* Add incremental work we have done to the @done output parameter. */
+    if ( unlikely(!guest_handle_is_null(pdone)) )
+    {
+        done += i;
+        copy_to_guest(pdone, &done, 1);
+    }
+
+    return rc;
 }
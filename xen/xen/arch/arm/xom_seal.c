@@ -7,9 +7,9 @@
 #include <xen/domain_page.h>
 #include <xen/guest_access.h>
 #include <xen/mem_access.h>
-#include <xen/rbtree.h>
+#include <xen/radix-tree.h>
+#include <xen/rcupdate.h>
 #include <xen/sched.h>
-#include <xen/xmalloc.h>
 #include <xen/xom_seal.h>
 #include <public/xen.h>
 
@@ -25,16 +25,8 @@
 #define gdprintk(...)
 #endif
 
-typedef union {
-    uint32_t lock_status;
-    uint8_t reg_clear_type;
-} info_spec_t;
-
-struct xom_page_info {
-    struct rb_node node;
-    gfn_t gfn;
-    info_spec_t info;
-};
+/* Readers of d->xom_reg_clear_pages; writers hold d->xom_page_lock. */
+static DEFINE_RCU_READ_LOCK(xom_reg_clear_rcu_lock);
 
 struct xom_subpage_write_info {
     uint8_t target_subpage;
@@ -46,84 +38,25 @@ struct xom_subpage_write_command {
     struct xom_subpage_write_info write_info[MAX_SUBPAGES_PER_CMD];
 };
 
-static int insert_page_info_node(struct rb_root *root, struct xom_page_info *info)
-{
-    struct rb_node **new, *parent;
-    struct xom_page_info *this;
-
-    new = &root->rb_node;
-    parent = NULL;
-
-    while ( *new )
-    {
-        this = container_of(*new, struct xom_page_info, node);
-        parent = *new;
-        if ( gfn_x(info->gfn) < gfn_x(this->gfn) )
-            new = &((*new)->rb_left);
-        else if ( gfn_x(info->gfn) > gfn_x(this->gfn) )
-            new = &((*new)->rb_right);
-        else
-            return -EEXIST;
-    }
-
-    rb_link_node(&info->node, parent, new);
-    rb_insert_color(&info->node, root);
-    return 0;
-}
-
-static struct xom_page_info *add_page_info_entry(struct rb_root *root,
-                                                const gfn_t gfn,
-                                                info_spec_t info)
-{
-    struct xom_page_info *data = xmalloc(struct xom_page_info);
-
-    if ( !data )
-        return NULL;
-
-    *data = (struct xom_page_info){
-        .gfn = gfn,
-        .info = info,
-    };
-    RB_CLEAR_NODE(&data->node);
-
-    if ( insert_page_info_node(root, data) < 0 )
-    {
-        xfree(data);
-        return NULL;
-    }
-
-    return data;
-}
+/* Run header of MMUEXT_WRITE_XOM_SPAGES_MULTI source pages (see x86). */
+struct xom_subpage_write_run {
+    uint64_t dest_gfn;
+    uint8_t num_subpages;
+    uint8_t reserved[7];
+};
 
-static void rm_page_info_entry(struct rb_root *root, struct xom_page_info *data)
+/*
+ * Per-page XOM state is kept in radix trees indexed by gfn, with the values
+ * stored in the slots themselves (see the x86 implementation).
+ */
+static inline uint32_t get_subpage_lock_status(void **slot)
 {
-    rb_erase(&data->node, root);
-    xfree(data);
+    return (uint32_t)radix_tree_ptr_to_int(*slot);
 }
 
-static struct xom_page_info *get_page_info_entry(struct rb_root *root,
-                                                 const gfn_t gfn)
+static inline void set_subpage_lock_status(void **slot, uint32_t lock_status)
 {
-    struct rb_node *node;
-    struct xom_page_info *entry;
-
-    if ( !root )
-        return NULL;
-
-    node = root->rb_node;
-
-    while ( node )
-    {
-        entry = container_of(node, struct xom_page_info, node);
-        if ( gfn_x(gfn) < gfn_x(entry->gfn) )
-            node = node->rb_left;
-        else if ( gfn_x(gfn) > gfn_x(entry->gfn) )
-            node = node->rb_right;
-        else
-            return entry;
-    }
-
-    return NULL;
+    radix_tree_replace_slot(slot, radix_tree_int_to_ptr((int)lock_status));
 }
 
 static int set_xom_seal(struct domain *d, gfn_t gfn, unsigned int nr_pages)
@@ -169,7 +102,6 @@ static int clear_xom_seal(struct domain *d, gfn_t gfn, unsigned int nr_pages)
     void *xom_page;
     struct p2m_domain *p2m;
     struct page_info *page;
-    struct xom_page_info *page_info;
     p2m_type_t ptype;
     p2m_access_t atype;
     gfn_t c_gfn;
@@ -221,12 +153,8 @@ static int clear_xom_seal(struct domain *d, gfn_t gfn, unsigned int nr_pages)
         if ( ret < 0 )
             goto exit;
 
-        page_info = get_page_info_entry(&d->xom_subpages, c_gfn);
-        if ( page_info )
-            rm_page_info_entry(&d->xom_subpages, page_info);
-        page_info = get_page_info_entry(&d->xom_reg_clear_pages, c_gfn);
-        if ( page_info )
-            rm_page_info_entry(&d->xom_reg_clear_pages, page_info);
+        radix_tree_delete(&d->xom_subpages, gfn_x(c_gfn));
+        radix_tree_delete(&d->xom_reg_clear_pages, gfn_x(c_gfn));
     }
 
  exit:
@@ -240,7 +168,6 @@ static int create_xom_subpages(struct domain *d, gfn_t gfn, unsigned int nr_page
     int ret = 0;
     unsigned int i;
     struct p2m_domain *p2m;
-    struct xom_page_info *subpage_info = NULL;
     p2m_type_t ptype;
     p2m_access_t atype;
     gfn_t c_gfn;
@@ -276,13 +203,10 @@ static int create_xom_subpages(struct domain *d, gfn_t gfn, unsigned int nr_page
         if ( ret < 0 )
             goto exit;
 
-        subpage_info = add_page_info_entry(&d->xom_subpages, c_gfn,
-                                           (info_spec_t){ .lock_status = 0 });
-        if ( !subpage_info )
-        {
-            ret = -ENOMEM;
+        ret = radix_tree_insert(&d->xom_subpages, gfn_x(c_gfn),
+                                radix_tree_int_to_ptr(0));
+        if ( ret < 0 )
             goto exit;
-        }
     }
 
  exit:
@@ -291,18 +215,70 @@ static int create_xom_subpages(struct domain *d, gfn_t gfn, unsigned int nr_page
     return ret;
 }
 
-static int write_into_subpage(struct domain *d, gfn_t gfn_dest, gfn_t gfn_src)
+/*
+ * Writes num_subpages entries of write_info, which point into a mapped guest
+ * page, into gfn_dest. The targets are read once, the data is copied directly.
+ */
+static int write_subpages(struct domain *d, gfn_t gfn_dest,
+                          const struct xom_subpage_write_info *write_info,
+                          unsigned int num_subpages)
 {
     unsigned int i;
-    char *xom_page, *write_dest;
-    struct p2m_domain *p2m;
+    uint32_t lock_status;
+    uint8_t targets[PAGE_SIZE / SUBPAGE_SIZE];
+    char *xom_page;
     struct page_info *page;
-    struct xom_page_info *subpage_info;
-    struct xom_subpage_write_command command;
+    void **subpage_slot;
+
+    if ( !num_subpages || num_subpages > ARRAY_SIZE(targets) )
+        return -EINVAL;
+
+    subpage_slot = radix_tree_lookup_slot(&d->xom_subpages, gfn_x(gfn_dest));
+    if ( !subpage_slot )
+        return -EINVAL;
+    lock_status = get_subpage_lock_status(subpage_slot);
+
+    gdprintk(XENLOG_WARNING, "Copying %u subpages to %lx\n",
+             num_subpages, gfn_x(gfn_dest));
+
+    for ( i = 0; i < num_subpages; i++ )
+    {
+        targets[i] = ACCESS_ONCE(write_info[i].target_subpage);
+        if ( targets[i] >= (PAGE_SIZE / SUBPAGE_SIZE) )
+            return -EINVAL;
+        if ( lock_status & (1 << targets[i]) )
+            return -EINVAL;
+    }
 
-    subpage_info = get_page_info_entry(&d->xom_subpages, gfn_dest);
-    if ( !subpage_info )
+    page = get_page_from_gfn(d, gfn_x(gfn_dest), NULL, P2M_ALLOC);
+    if ( !page )
         return -EINVAL;
+    if ( !get_page_type(page, PGT_writable_page) )
+    {
+        put_page(page);
+        return -EPERM;
+    }
+    xom_page = (char *)__map_domain_page(page);
+    for ( i = 0; i < num_subpages; i++ )
+    {
+        memcpy(xom_page + (targets[i] * SUBPAGE_SIZE), write_info[i].data,
+               SUBPAGE_SIZE);
+        lock_status |= 1 << targets[i];
+    }
+    set_subpage_lock_status(subpage_slot, lock_status);
+    unmap_domain_page(xom_page);
+    put_page_and_type(page);
+
+    return 0;
+}
+
+static int write_into_subpage(struct domain *d, gfn_t gfn_dest, gfn_t gfn_src)
+{
+    int ret;
+    unsigned int num_subpages;
+    const struct xom_subpage_write_command *command;
+    struct p2m_domain *p2m;
+    struct page_info *page;
 
     p2m = p2m_get_hostp2m(d);
 
@@ -315,25 +291,101 @@ static int write_into_subpage(struct domain *d, gfn_t gfn_dest, gfn_t gfn_src)
     page = get_page_from_gfn(d, gfn_x(gfn_src), NULL, P2M_ALLOC);
     if ( !page )
         return -EINVAL;
-    xom_page = (char *)map_domain_page(page);
-    memcpy(&command, xom_page, sizeof(command));
-    unmap_domain_page(xom_page);
+    command = __map_domain_page(page);
+
+    num_subpages = ACCESS_ONCE(command->num_subpages);
+    if ( num_subpages > MAX_SUBPAGES_PER_CMD )
+        ret = -EINVAL;
+    else
+        ret = write_subpages(d, gfn_dest, command->write_info, num_subpages);
+
+    unmap_domain_page(command);
     put_page(page);
+    return ret;
+}
 
-    gdprintk(XENLOG_WARNING, "Copying %u subpages from %lx to %lx\n",
-             command.num_subpages, gfn_x(gfn_src), gfn_x(gfn_dest));
+static int write_into_subpages_multi(struct domain *d, gfn_t gfn_src,
+                                     unsigned int nr_pages)
+{
+    int ret = 0;
+    unsigned int i, offset, num_subpages;
+    uint64_t dest_gfn;
+    const uint8_t *src_page;
+    const struct xom_subpage_write_run *run;
+    struct p2m_domain *p2m;
+    struct page_info *page;
+
+    p2m = p2m_get_hostp2m(d);
+
+    if ( unlikely(!p2m) )
+        return -EFAULT;
 
-    if ( command.num_subpages > MAX_SUBPAGES_PER_CMD )
+    if ( !nr_pages )
         return -EINVAL;
-    for ( i = 0; i < command.num_subpages; i++ )
+
+    if ( gfn_x(gfn_src) + nr_pages > gfn_x(p2m->max_mapped_gfn) + 1 )
+        return -EOVERFLOW;
+
+    for ( i = 0; i < nr_pages && !ret; i++ )
     {
-        if ( command.write_info[i].target_subpage >= (PAGE_SIZE / SUBPAGE_SIZE) )
-            return -EINVAL;
-        if ( subpage_info->info.lock_status & (1 << command.write_info[i].target_subpage) )
+        page = get_page_from_gfn(d, gfn_x(gfn_src) + i, NULL, P2M_ALLOC);
+        if ( !page )
             return -EINVAL;
+        src_page = __map_domain_page(page);
+
+        for ( offset = 0; offset + sizeof(*run) <= PAGE_SIZE; )
+        {
+            run = (const struct xom_subpage_write_run *)(src_page + offset);
+            dest_gfn = ACCESS_ONCE(run->dest_gfn);
+            num_subpages = ACCESS_ONCE(run->num_subpages);
+            offset += sizeof(*run);
+
+            if ( !num_subpages ||
+                 offset + num_subpages * sizeof(struct xom_subpage_write_info) >
+                 PAGE_SIZE )
+                break;
+            if ( dest_gfn > gfn_x(p2m->max_mapped_gfn) )
+            {
+                ret = -EOVERFLOW;
+                break;
+            }
+
+            ret = write_subpages(d, _gfn(dest_gfn),
+                                 (const struct xom_subpage_write_info *)
+                                 (src_page + offset), num_subpages);
+            if ( ret < 0 )
+                break;
+            offset += num_subpages * sizeof(struct xom_subpage_write_info);
+        }
+
+        unmap_domain_page(src_page);
+        put_page(page);
     }
 
-    page = get_page_from_gfn(d, gfn_x(gfn_dest), NULL, P2M_ALLOC);
+    return ret;
+}
+
+/*
+ * Scrubs the subpages of gfn in subpage_mask with int3 and unlocks them, so
+ * that they can be written again.
+ */
+static int free_subpages(struct domain *d, gfn_t gfn, uint32_t subpage_mask)
+{
+    unsigned int i;
+    uint32_t lock_status;
+    char *xom_page;
+    struct page_info *page;
+    void **subpage_slot;
+
+    subpage_slot = radix_tree_lookup_slot(&d->xom_subpages, gfn_x(gfn));
+    if ( !subpage_slot )
+        return -EINVAL;
+    lock_status = get_subpage_lock_status(subpage_slot);
+
+    if ( !subpage_mask || (subpage_mask & ~lock_status) )
+        return -EINVAL;
+
+    page = get_page_from_gfn(d, gfn_x(gfn), NULL, P2M_ALLOC);
     if ( !page )
         return -EINVAL;
     if ( !get_page_type(page, PGT_writable_page) )
@@ -341,13 +393,13 @@ static int write_into_subpage(struct domain *d, gfn_t gfn_dest, gfn_t gfn_src)
         put_page(page);
         return -EPERM;
     }
-    xom_page = (char *)map_domain_page(page);
-    for ( i = 0; i < command.num_subpages; i++ )
+    xom_page = (char *)__map_domain_page(page);
+    for ( i = 0; i < PAGE_SIZE / SUBPAGE_SIZE; i++ )
     {
-        write_dest = xom_page + (command.write_info[i].target_subpage * SUBPAGE_SIZE);
-        memcpy(write_dest, command.write_info[i].data, SUBPAGE_SIZE);
-        subpage_info->info.lock_status |= 1 << command.write_info[i].target_subpage;
+        if ( subpage_mask & (1u << i) )
+            memset(xom_page + i * SUBPAGE_SIZE, 0xcc, SUBPAGE_SIZE);
     }
+    set_subpage_lock_status(subpage_slot, lock_status & ~subpage_mask);
     unmap_domain_page(xom_page);
     put_page_and_type(page);
 
@@ -357,16 +409,14 @@ static int write_into_subpage(struct domain *d, gfn_t gfn_dest, gfn_t gfn_src)
 static int mark_reg_clear_page(struct domain *d, gfn_t gfn,
                                unsigned int reg_clear_type)
 {
-    struct xom_page_info *page_info;
     struct p2m_domain *p2m;
     p2m_type_t ptype;
     p2m_access_t atype;
 
-    if ( !reg_clear_type || reg_clear_type > REG_CLEAR_TYPE_FULL )
+    if ( !reg_clear_desc_valid(reg_clear_type) )
         return -EINVAL;
 
-    page_info = get_page_info_entry(&d->xom_reg_clear_pages, gfn);
-    if ( page_info )
+    if ( radix_tree_lookup(&d->xom_reg_clear_pages, gfn_x(gfn)) )
         return -EINVAL;
 
     p2m = p2m_get_hostp2m(d);
@@ -376,20 +426,16 @@ static int mark_reg_clear_page(struct domain *d, gfn_t gfn,
     if ( atype != p2m_access_x )
         return -EINVAL;
 
-    page_info = add_page_info_entry(&d->xom_reg_clear_pages, gfn,
-                                    (info_spec_t){ .reg_clear_type = reg_clear_type });
-    if ( !page_info )
-        return -ENOMEM;
-
-    return 0;
+    return radix_tree_insert(&d->xom_reg_clear_pages, gfn_x(gfn),
+                             radix_tree_int_to_ptr(reg_clear_type));
 }
 
 int handle_xom_seal(struct vcpu *curr,
                     XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops,
                     unsigned int count,
-                    XEN_GUEST_HANDLE_PARAM(uint) pdone)
+                    unsigned int *done)
 {
-    int rc;
+    int rc = 0;
     unsigned int i;
     struct domain *d = curr->domain;
     struct mmuext_op op;
@@ -398,14 +444,15 @@ int handle_xom_seal(struct vcpu *curr,
     {
         if ( (i && hypercall_preempt_check()) )
         {
-            gdprintk(XENLOG_ERR, "Preempt check failed\n");
-            return -ERESTART;
+            rc = -ERESTART;
+            break;
         }
 
         if ( unlikely(__copy_from_guest(&op, uops, 1) != 0) )
         {
             gdprintk(XENLOG_ERR, "Unable to copy guest op\n");
-            return -EFAULT;
+            rc = -EFAULT;
+            break;
         }
 
         spin_lock(&d->xom_page_lock);
@@ -423,6 +470,13 @@ int handle_xom_seal(struct vcpu *curr,
         case MMUEXT_WRITE_XOM_SPAGES:
             rc = write_into_subpage(d, _gfn(op.arg1.mfn), _gfn(op.arg2.src_mfn));
             break;
+        case MMUEXT_WRITE_XOM_SPAGES_MULTI:
+            rc = write_into_subpages_multi(d, _gfn(op.arg1.mfn),
+                                           op.arg2.nr_ents);
+            break;
+        case MMUEXT_FREE_XOM_SPAGES:
+            rc = free_subpages(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
+            break;
         case MMUEXT_MARK_REG_CLEAR:
             rc = mark_reg_clear_page(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
             break;
@@ -431,39 +485,19 @@ int handle_xom_seal(struct vcpu *curr,
         }
         spin_unlock(&d->xom_page_lock);
 
-        guest_handle_add_offset(uops, 1);
         if ( rc < 0 )
-            return rc;
+            break;
+        guest_handle_add_offset(uops, 1);
     }
 
-    if ( unlikely(!guest_handle_is_null(pdone)) )
-        copy_to_guest(pdone, &i, 1);
-    return 0;
+    *done = i;
+    return rc;
 }
 
-static void free_xom_info_node(struct rb_node *node)
+void free_xom_info(struct domain *d)
 {
-    struct xom_page_info *data;
-
-    if ( !node )
-        return;
-
-    data = rb_entry(node, struct xom_page_info, node);
-
-    if ( node->rb_left )
-        free_xom_info_node(node->rb_left);
-    if ( node->rb_right )
-        free_xom_info_node(node->rb_right);
-
-    xfree(data);
-}
-
-void free_xom_info(struct rb_root *root)
-{
-    if ( root->rb_node )
-        free_xom_info_node(root->rb_node);
-
-    *root = RB_ROOT;
+    radix_tree_destroy(&d->xom_subpages, NULL);
+    radix_tree_destroy(&d->xom_reg_clear_pages, NULL);
 }
 
 static gfn_t gfn_of_pc(register_t pc)
@@ -487,7 +521,7 @@ static gfn_t gfn_of_pc(register_t pc)
 unsigned char get_reg_clear_type(const struct cpu_user_regs *regs)
 {
     unsigned char ret = REG_CLEAR_TYPE_NONE;
-    struct xom_page_info *info;
+    void *entry;
     gfn_t instr_gfn;
     struct vcpu *v = current;
     struct domain *d;
@@ -501,12 +535,10 @@ unsigned char get_reg_clear_type(const struct cpu_user_regs *regs)
     if ( unlikely(gfn_eq(instr_gfn, INVALID_GFN)) )
         return ret;
 
-    spin_lock(&d->xom_page_lock);
-
-    info = get_page_info_entry(&d->xom_reg_clear_pages, instr_gfn);
-    if ( info )
-        ret = info->info.reg_clear_type;
-
-    spin_unlock(&d->xom_page_lock);
+    rcu_read_lock(&xom_reg_clear_rcu_lock);
+    entry = radix_tree_lookup(&d->xom_reg_clear_pages, gfn_x(instr_gfn));
+    if ( entry )
+        ret = (unsigned char)radix_tree_ptr_to_int(entry);
+    rcu_read_unlock(&xom_reg_clear_rcu_lock);
     return ret;
 }
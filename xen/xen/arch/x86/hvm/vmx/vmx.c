@@ -4085,6 +4085,13 @@ static void handle_register_clear(struct cpu_user_regs *regs)
         uintptr_t bp;
     } reg_backup;
 
+    // Most domains never mark a page, so don't even read the CPL for them
+    if (!atomic_read(&current->domain->xom_nr_reg_clear_pages))
+    {
+        perfc_incr(xom_reg_clear_skip);
+        return;
+    }
+
     // We leave the kernel alone
     if (!(hvm_get_cpl(current) & 2))
         return;
@@ -4093,14 +4100,33 @@ static void handle_register_clear(struct cpu_user_regs *regs)
     if (reg_clear_type == REG_CLEAR_TYPE_NONE)
         return;
 
-    if (cpu_has_avx512f)
-        clear_avx512_regs();
-    else if (cpu_has_avx)
-        clear_avx_regs();
-    else if (cpu_has_sse3)
-        clear_sse_regs();
+    perfc_incr(xom_reg_clear_done);
+
+    // Only clear the vector state the marked code can have touched
+    switch (reg_clear_width(reg_clear_type))
+    {
+    case REG_CLEAR_WIDTH_WIDEST:
+    case REG_CLEAR_WIDTH_AVX512:
+        if (cpu_has_avx512f)
+        {
+            clear_avx512_regs();
+            break;
+        }
+        fallthrough;
+    case REG_CLEAR_WIDTH_AVX:
+        if (cpu_has_avx)
+        {
+            clear_avx_regs();
+            break;
+        }
+        fallthrough;
+    case REG_CLEAR_WIDTH_SSE:
+        if (cpu_has_sse3)
+            clear_sse_regs();
+        break;
+    }
 
-    if (reg_clear_type == REG_CLEAR_TYPE_VECTOR)
+    if (reg_clear_gprs(reg_clear_type) == REG_CLEAR_TYPE_VECTOR)
     {
         regs->r15 = regs->r14 = 0xbabababababababaull;
         return;
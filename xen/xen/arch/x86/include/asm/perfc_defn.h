@@ -131,4 +131,8 @@ PERFCOUNTER(iommu_pt_coalesces,   "IOMMU page table coalesces")
 PERFCOUNTER(buslock, "Bus Locks Detected")
 PERFCOUNTER(vmnotify_crash, "domain crashes by Notify VM Exit")
 
+PERFCOUNTER(xom_reg_clear_skip,  "xom reg clear: no marked pages")
+PERFCOUNTER(xom_reg_clear_walk,  "xom reg clear: guest page walks")
+PERFCOUNTER(xom_reg_clear_done,  "xom reg clear: registers cleared")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -3472,8 +3472,21 @@ long do_mmuext_op(
 
     if ( !is_pv_domain(pg_owner) )
     {
-        rc = handle_xom_seal(curr, uops, count, pdone);
+        rc = handle_xom_seal(curr, uops, count, &i);
+        if ( rc == -ERESTART )
+        {
+            guest_handle_add_offset(uops, i);
+            rc = hypercall_create_continuation(
+                __HYPERVISOR_mmuext_op, "hihi",
+                uops, (count - i) | MMU_UPDATE_PREEMPTED, pdone, foreigndom);
+        }
         put_pg_owner(pg_owner);
+
+        if ( unlikely(!guest_handle_is_null(pdone)) )
+        {
+            done += i;
+            copy_to_guest(pdone, &done, 1);
+        }
         return rc;
     }
 
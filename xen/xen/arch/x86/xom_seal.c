@@ -2,8 +2,8 @@
 #ifdef CONFIG_HVM
 #include <xen/mem_access.h>
 #include <xen/sched.h>
-#include <xen/rbtree.h>
-#include <xen/xmalloc.h>
+#include <xen/radix-tree.h>
+#include <xen/rcupdate.h>
 #include <xen/guest_access.h>
 #include <xen/domain_page.h>
 #include <xen/xom_seal.h>
@@ -20,16 +20,8 @@
 #define gdprintk(...)
 #endif
 
-typedef union {
-        uint32_t lock_status;
-        uint8_t reg_clear_type;
-} info_spec_t;
-
-struct {
-    struct rb_node node;
-    gfn_t gfn;
-    info_spec_t info;
-} typedef xom_page_info;
+// Protects readers of d->xom_reg_clear_pages, which is only modified under d->xom_page_lock
+static DEFINE_RCU_READ_LOCK(xom_reg_clear_rcu_lock);
 
 struct {
     uint8_t target_subpage;
@@ -41,82 +33,121 @@ struct {
     xom_subpage_write_info write_info [MAX_SUBPAGES_PER_CMD];
 } typedef xom_subpage_write_command;
 
-static int insert_page_info_node(struct rb_root* root, xom_page_info* info) {
-	struct rb_node **new, *parent;
-    xom_page_info* this;
-
-	new = &root->rb_node;
-	parent = NULL;
-
-	while (*new) {
-		this = container_of(*new, xom_page_info, node);
+/*
+ * Source pages of MMUEXT_WRITE_XOM_SPAGES_MULTI are packed with runs. Each run is this header,
+ * followed by num_subpages xom_subpage_write_info entries for the page dest_gfn. A run with
+ * num_subpages == 0, or one that would not fit into the rest of the page, ends the page.
+ */
+struct {
+    uint64_t dest_gfn;
+    uint8_t num_subpages;
+    uint8_t reserved[7];
+} typedef xom_subpage_write_run;
 
-		parent = *new;
-		if (gfn_x(info->gfn) < gfn_x(this->gfn))
-			new = &((*new)->rb_left);
-		else if (gfn_x(info->gfn) > gfn_x(this->gfn))
-			new = &((*new)->rb_right);
-		else
-			return -EEXIST;
-	}
+/*
+ * Per-page XOM state lives in radix trees indexed by gfn. The values are stored directly
+ * in the slots (radix_tree_int_to_ptr), so marking a page never allocates a node of its own,
+ * lookups are O(1) and the trees' memory scales with the sealed gfn ranges.
+ */
+static inline uint32_t get_subpage_lock_status(void **slot) {
+    return (uint32_t) radix_tree_ptr_to_int(*slot);
+}
 
-	rb_link_node(&info->node, parent, new);
-	rb_insert_color(&info->node, root);
-	return 0;
+static inline void set_subpage_lock_status(void **slot, uint32_t lock_status) {
+    radix_tree_replace_slot(slot, radix_tree_int_to_ptr((int) lock_status));
 }
 
-static xom_page_info* add_page_info_entry(struct rb_root* root, const gfn_t gfn, info_spec_t info){
-    xom_page_info *data  = xmalloc(xom_page_info); 
+// Must be called whenever a page is added to or removed from xom_reg_clear_pages
+static void reg_clear_pages_changed(struct domain* d, int delta) {
+    atomic_add(delta, &d->xom_nr_reg_clear_pages);
+}
 
-    if(!data)
-        return NULL;
-    
-    *data = (xom_page_info) {
-        .gfn = gfn,
-        .info = info,
-    };
-    RB_CLEAR_NODE(&data->node);
-
-    if (insert_page_info_node(root, data) < 0) {
-        xfree(data);
-        return NULL;
-    }
+/*
+ * All range operations below run with the p2m lock held by handle_xom_seal. Holding it
+ * defers the EPT flush of every set_entry() until the lock is dropped at the end of the
+ * mmuext batch. Ranges are preempted every XOM_PREEMPT_MASK + 1 pages; in that case the
+ * number of pages already processed is returned, so that the op can be resumed.
+ */
+#define XOM_PREEMPT_MASK 0x1ff
+#define XOM_SUPERPAGE_NR (1U << PAGE_ORDER_2M)
 
-    return data;
+// Whether processing the pages [from, to) of a range crossed a preemption point
+static inline bool xom_range_preempt(unsigned int from, unsigned int to, unsigned int nr_pages) {
+    return nr_pages > to && (from | XOM_PREEMPT_MASK) < to && hypercall_preempt_check();
 }
 
-static void rm_page_info_entry(struct rb_root *root, xom_page_info *data) {
-    rb_erase(&data->node, root);
-    xfree(data);
+/*
+ * Checks whether the XOM_SUPERPAGE_NR pages at gfn can be covered by a single 2MB EPT entry,
+ * so that sealing them does not shatter a superpage. This requires a 2MB-aligned gfn and mfn,
+ * contiguous backing, and the same type and access for all pages. Pages that were already
+ * split into 4K entries are merged again. Domains without exec_sp get their executable
+ * superpages shattered on the first instruction fetch (XSA-304), so they are sealed at 4K,
+ * as are all pages if the EPT cannot hold 2MB entries.
+ */
+static bool xom_superpage_range(struct p2m_domain *p2m, gfn_t gfn, unsigned int nr_pages,
+                                mfn_t *mfn, p2m_type_t *ptype, p2m_access_t *atype) {
+    unsigned int i, order;
+    mfn_t c_mfn;
+    p2m_type_t c_ptype;
+    p2m_access_t c_atype;
+
+    if ( nr_pages < XOM_SUPERPAGE_NR || !IS_ALIGNED(gfn_x(gfn), XOM_SUPERPAGE_NR) )
+        return false;
+
+    if ( !hap_has_2mb || !p2m->domain->arch.hvm.vmx.exec_sp )
+        return false;
+
+    *mfn = p2m->get_entry(p2m, gfn, ptype, atype, 0, &order, NULL);
+    if ( !p2m_is_ram(*ptype) || mfn_eq(*mfn, INVALID_MFN) || !IS_ALIGNED(mfn_x(*mfn), XOM_SUPERPAGE_NR) )
+        return false;
+    if ( order >= PAGE_ORDER_2M )
+        return true;
+
+    for ( i = 1; i < XOM_SUPERPAGE_NR; i++ ) {
+        c_mfn = p2m->get_entry(p2m, gfn_add(gfn, i), &c_ptype, &c_atype, 0, NULL, NULL);
+        if ( !mfn_eq(c_mfn, mfn_add(*mfn, i)) || c_ptype != *ptype || c_atype != *atype )
+            return false;
+    }
+
+    return true;
 }
 
-static xom_page_info* get_page_info_entry(struct rb_root* root, const gfn_t gfn){
-    struct rb_node *node;
-    xom_page_info *entry;
+// Overwrites an XOM page with 0x90 before it becomes readable again
+static int scrub_xom_page(struct domain* d, gfn_t gfn) {
+    void* xom_page;
+    struct page_info *page;
 
-    if(!root)
-        return NULL;
+    // Map the page into our address space
+    page = get_page_from_gfn(d, gfn_x(gfn), NULL, P2M_ALLOC);
+    if (!page)
+        return -EINVAL;
 
-    node = root->rb_node;
+    if (!get_page_type(page, PGT_writable_page)) {
+        put_page(page);
+        return -EPERM;
+    }
 
-    while (node) {
-        entry = container_of(node, xom_page_info, node);
+    xom_page = __map_domain_page(page);
+    memset(xom_page, 0x90, PAGE_SIZE);
+    unmap_domain_page(xom_page);
+    put_page_and_type(page);
 
-        if (gfn_x(gfn) < gfn_x(entry->gfn))
-            node = node->rb_left;
-        else if (gfn_x(gfn) > gfn_x(entry->gfn))
-            node = node->rb_right;
-        else
-            return entry;
-    }
+    return 0;
+}
 
-    return NULL;
+static void forget_xom_page(struct domain* d, gfn_t gfn) {
+    radix_tree_delete(&d->xom_subpages, gfn_x(gfn));
+    if (radix_tree_delete(&d->xom_reg_clear_pages, gfn_x(gfn)))
+        reg_clear_pages_changed(d, -1);
 }
 
-static int set_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
+static long set_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
     int ret = 0;
-    unsigned int i;
+    unsigned int i, step;
     struct p2m_domain *p2m;
+    p2m_type_t ptype;
+    p2m_access_t atype;
+    mfn_t mfn;
     gfn_t c_gfn;
 
     p2m = p2m_get_hostp2m(d);
@@ -132,28 +163,35 @@ static int set_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
     if ( gfn_x(gfn) + nr_pages > p2m->max_mapped_pfn )
         return -EOVERFLOW;
 
-    for ( i = 0; i < nr_pages; i++) {
-        c_gfn = _gfn(gfn_x(gfn) + i);
-        gfn_lock(p2m, c_gfn, 0);
-        ret = p2m_set_mem_access_single(d, p2m, NULL, p2m_access_x, c_gfn);
-        gfn_unlock(p2m, c_gfn, 0);
+    ASSERT(p2m_locked_by_me(p2m));
+
+    for ( i = 0; i < nr_pages; i += step ) {
+        c_gfn = gfn_add(gfn, i);
+
+        if ( xom_superpage_range(p2m, c_gfn, nr_pages - i, &mfn, &ptype, &atype) ) {
+            step = XOM_SUPERPAGE_NR;
+            ret = p2m->set_entry(p2m, c_gfn, mfn, PAGE_ORDER_2M, ptype, p2m_access_x, -1);
+        } else {
+            step = 1;
+            ret = p2m_set_mem_access_single(d, p2m, NULL, p2m_access_x, c_gfn);
+        }
         if (ret < 0)
-            break;
+            return ret;
+
+        if ( xom_range_preempt(i, i + step, nr_pages) )
+            return i + step;
     }
 
-    p2m->tlb_flush(p2m);
-    return ret;
+    return 0;
 }
 
-static int clear_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
+static long clear_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
     int ret = 0;
-    unsigned int i;
-    void* xom_page;
+    unsigned int i, j, step;
     struct p2m_domain *p2m;
-    struct page_info *page;
-    xom_page_info* page_info;
     p2m_type_t ptype;
     p2m_access_t atype;
+    mfn_t mfn;
     gfn_t c_gfn;
 
     p2m = p2m_get_hostp2m(d);
@@ -169,62 +207,58 @@ static int clear_xom_seal(struct domain* d, gfn_t gfn, unsigned int nr_pages){
     if ( gfn_x(gfn) + nr_pages > p2m->max_mapped_pfn )
         return -EOVERFLOW;
 
-
-    for ( i = 0; i < nr_pages; i++ ) {
-        c_gfn = _gfn(gfn_x(gfn) + i);
-
-        gfn_lock(p2m, c_gfn, 0);
-        // Check whether the provided gfn is actually an XOM page
-        p2m->get_entry(p2m, c_gfn, &ptype, &atype, 0, NULL, NULL);
-        if (atype != p2m_access_x){
-            gfn_unlock(p2m, c_gfn, 0);
-            continue;
-        }
-
-        // Map the page into our address space
-        page = get_page_from_gfn(d, gfn_x(c_gfn), NULL, P2M_ALLOC);
-
-        if (!page) {
-            ret = -EINVAL;
-            gfn_unlock(p2m, c_gfn, 0);
-            goto exit;
-        }
-
-        if (!get_page_type(page, PGT_writable_page)) {
-            put_page(page);
-            gfn_unlock(p2m, c_gfn, 0);
-            ret = -EPERM;
-            goto exit;
+    ASSERT(p2m_locked_by_me(p2m));
+
+    for ( i = 0; i < nr_pages; i += step ) {
+        c_gfn = gfn_add(gfn, i);
+
+        // Unseal whole XOM superpages without splitting them
+        if ( xom_superpage_range(p2m, c_gfn, nr_pages - i, &mfn, &ptype, &atype) &&
+             atype == p2m_access_x ) {
+            step = XOM_SUPERPAGE_NR;
+            for ( j = 0; j < step; j++ ) {
+                ret = scrub_xom_page(d, gfn_add(c_gfn, j));
+                if (ret < 0)
+                    return ret;
+            }
+
+            // Set SLAT permissions to RWX
+            ret = p2m->set_entry(p2m, c_gfn, mfn, PAGE_ORDER_2M, ptype, p2m_access_rwx, -1);
+            if (ret < 0)
+                return ret;
+
+            for ( j = 0; j < step; j++ )
+                forget_xom_page(d, gfn_add(c_gfn, j));
+        } else {
+            step = 1;
+
+            // Check whether the provided gfn is actually an XOM page
+            p2m->get_entry(p2m, c_gfn, &ptype, &atype, 0, NULL, NULL);
+            if (atype == p2m_access_x){
+                ret = scrub_xom_page(d, c_gfn);
+                if (ret < 0)
+                    return ret;
+
+                // Set SLAT permissions to RWX
+                ret = p2m_set_mem_access_single(d, p2m, NULL, p2m_access_rwx, c_gfn);
+                if (ret < 0)
+                    return ret;
+
+                forget_xom_page(d, c_gfn);
+            }
         }
 
-        // Overwrite XOM page with 0x90
-        xom_page = __map_domain_page(page);
-        memset(xom_page, 0x90, PAGE_SIZE);
-        unmap_domain_page(xom_page);
-        put_page_and_type(page);
-
-        // Set SLAT permissions to RWX
-        ret = p2m_set_mem_access_single(d, p2m, NULL, p2m_access_rwx, c_gfn);
-        gfn_unlock(p2m, c_gfn, 0);
-
-        page_info = get_page_info_entry(&d->xom_subpages, c_gfn);
-        if(page_info)
-            rm_page_info_entry(&d->xom_subpages, page_info);
-        page_info = get_page_info_entry(&d->xom_reg_clear_pages, c_gfn);
-        if (page_info)
-            rm_page_info_entry(&d->xom_reg_clear_pages, page_info);
+        if ( xom_range_preempt(i, i + step, nr_pages) )
+            return i + step;
     }
 
-exit:
-    p2m->tlb_flush(p2m);
-    return ret;
+    return 0;
 }
 
-static int create_xom_subpages(struct domain* d, gfn_t gfn, unsigned int nr_pages){
+static long create_xom_subpages(struct domain* d, gfn_t gfn, unsigned int nr_pages){
     int ret = 0;
     unsigned int i;
     struct p2m_domain *p2m;
-    xom_page_info* subpage_info = NULL;
     p2m_type_t ptype;
     p2m_access_t atype;
     gfn_t c_gfn;
@@ -242,47 +276,92 @@ static int create_xom_subpages(struct domain* d, gfn_t gfn, unsigned int nr_page
     if ( gfn_x(gfn) + nr_pages > p2m->max_mapped_pfn )
         return -EOVERFLOW;
 
-    for ( i = 0; i < nr_pages; i++) {
-        c_gfn = _gfn(gfn_x(gfn) + i);
+    ASSERT(p2m_locked_by_me(p2m));
+
+    for ( i = 0; i < nr_pages; i++ ) {
+        c_gfn = gfn_add(gfn, i);
 
-        gfn_lock(p2m, c_gfn, 0);
         // Check whether the provided gfn is a XOM page already
         p2m->get_entry(p2m, c_gfn, &ptype, &atype, 0, NULL, NULL);
-        if (atype == p2m_access_x){
-            gfn_unlock(p2m, c_gfn, 0);
-            ret = -EINVAL;
-            goto exit;
-        }
+        if (atype == p2m_access_x)
+            return -EINVAL;
 
         // Set SLAT permissions to X
         ret = p2m_set_mem_access_single(d, p2m, NULL, p2m_access_x, c_gfn);
-        gfn_unlock(p2m, c_gfn, 0);
+        if (ret < 0)
+            return ret;
 
-        
-        subpage_info = add_page_info_entry(&d->xom_subpages, c_gfn, (info_spec_t) {.lock_status = 0});
-        if (!subpage_info) {
-            ret = -ENOMEM;
-            goto exit;
-        }
+        ret = radix_tree_insert(&d->xom_subpages, gfn_x(c_gfn), radix_tree_int_to_ptr(0));
+        if (ret < 0)
+            return ret;
+
+        if ( xom_range_preempt(i, i + 1, nr_pages) )
+            return i + 1;
     }
 
-exit:
-    p2m->tlb_flush(p2m);
-    return ret;
+    return 0;
 }
 
-static int write_into_subpage(struct domain* d, gfn_t gfn_dest, gfn_t gfn_src){
+/*
+ * Writes num_subpages entries of write_info into the subpages of gfn_dest and locks them.
+ * write_info points into a mapped guest page, which other vCPUs may modify concurrently.
+ * The target indices are therefore read exactly once, while the data is copied directly.
+ */
+static int write_subpages(struct domain* d, gfn_t gfn_dest,
+                          const xom_subpage_write_info* write_info, unsigned int num_subpages){
     unsigned int i;
-    char* xom_page, *write_dest;
-    struct p2m_domain *p2m;
+    uint32_t lock_status;
+    uint8_t targets[PAGE_SIZE / SUBPAGE_SIZE];
+    char* xom_page;
     struct page_info *page;
-    xom_page_info* subpage_info;
-    xom_subpage_write_command command;
+    void **subpage_slot;
 
-    subpage_info = get_page_info_entry(&d->xom_subpages, gfn_dest);
-    if(!subpage_info)
+    if(!num_subpages || num_subpages > ARRAY_SIZE(targets))
         return -EINVAL;
 
+    subpage_slot = radix_tree_lookup_slot(&d->xom_subpages, gfn_x(gfn_dest));
+    if(!subpage_slot)
+        return -EINVAL;
+    lock_status = get_subpage_lock_status(subpage_slot);
+
+    gdprintk(XENLOG_WARNING, "Copying %u subpages to %lx\n", num_subpages, gfn_x(gfn_dest));
+
+    // Validate command
+    for(i = 0; i < num_subpages; i++){
+        targets[i] = ACCESS_ONCE(write_info[i].target_subpage);
+        if(targets[i] >= (PAGE_SIZE / SUBPAGE_SIZE))
+            return -EINVAL;
+        if(lock_status & (1 << targets[i]))
+            return -EINVAL;
+    }
+
+    // Execute command
+    page = get_page_from_gfn(d, gfn_x(gfn_dest), NULL, P2M_ALLOC);
+    if(!page)
+        return -EINVAL;
+    if (!get_page_type(page, PGT_writable_page)) {
+        put_page(page);
+        return -EPERM;
+    }
+    xom_page = (char*) __map_domain_page(page);
+    for(i = 0; i < num_subpages; i++){
+        memcpy(xom_page + (targets[i] * SUBPAGE_SIZE), write_info[i].data, SUBPAGE_SIZE);
+        lock_status |= 1 << targets[i];
+    }
+    set_subpage_lock_status(subpage_slot, lock_status);
+    unmap_domain_page(xom_page);
+    put_page_and_type(page);
+
+    return 0;
+}
+
+static int write_into_subpage(struct domain* d, gfn_t gfn_dest, gfn_t gfn_src){
+    int ret;
+    unsigned int num_subpages;
+    const xom_subpage_write_command* command;
+    struct p2m_domain *p2m;
+    struct page_info *page;
+
     p2m = p2m_get_hostp2m(d);
 
     if ( unlikely(!p2m) )
@@ -291,108 +370,184 @@ static int write_into_subpage(struct domain* d, gfn_t gfn_dest, gfn_t gfn_src){
     if (gfn_x(gfn_src) > p2m->max_mapped_pfn )
         return -EOVERFLOW;
 
-    // Copy command from gfn_src
-    gfn_lock(p2m, gfn_src, 0);
     page = get_page_from_gfn(d, gfn_x(gfn_src), NULL, P2M_ALLOC);
-    if(!page){
-        gfn_unlock(p2m, gfn_src, 0);
+    if(!page)
         return -EINVAL;
-    }
-    xom_page = (char*) __map_domain_page(page);
-    memcpy(&command, xom_page, sizeof(command));
-    unmap_domain_page(xom_page);
-    gfn_unlock(p2m, gfn_src, 0);
+    command = __map_domain_page(page);
+
+    num_subpages = ACCESS_ONCE(command->num_subpages);
+    if(num_subpages > MAX_SUBPAGES_PER_CMD)
+        ret = -EINVAL;
+    else
+        ret = write_subpages(d, gfn_dest, command->write_info, num_subpages);
+
+    unmap_domain_page(command);
     put_page(page);
+    return ret;
+}
+
+static long write_into_subpages_multi(struct domain* d, gfn_t gfn_src, unsigned int nr_pages){
+    int ret = 0;
+    unsigned int i, offset, num_subpages;
+    uint64_t dest_gfn;
+    const uint8_t* src_page;
+    const xom_subpage_write_run* run;
+    struct p2m_domain *p2m;
+    struct page_info *page;
 
-    gdprintk(XENLOG_WARNING, "Copying %u subpages from %lx to %lx\n", command.num_subpages, gfn_x(gfn_src), gfn_x(gfn_dest));
+    p2m = p2m_get_hostp2m(d);
 
-    // Validate command
-    if(command.num_subpages > MAX_SUBPAGES_PER_CMD)
+    if ( unlikely(!p2m) )
+        return -EFAULT;
+
+    if (!nr_pages)
         return -EINVAL;
-    for(i = 0; i < command.num_subpages; i++){
-        if(command.write_info[i].target_subpage >= (PAGE_SIZE / SUBPAGE_SIZE))
-            return -EINVAL;
-        if(subpage_info->info.lock_status & (1 << command.write_info[i].target_subpage))
+
+    if ( gfn_x(gfn_src) + nr_pages > p2m->max_mapped_pfn )
+        return -EOVERFLOW;
+
+    for ( i = 0; i < nr_pages; i++ ) {
+        page = get_page_from_gfn(d, gfn_x(gfn_src) + i, NULL, P2M_ALLOC);
+        if(!page)
             return -EINVAL;
+        src_page = __map_domain_page(page);
+
+        for ( offset = 0; offset + sizeof(*run) <= PAGE_SIZE; ) {
+            run = (const xom_subpage_write_run*) (src_page + offset);
+            dest_gfn = ACCESS_ONCE(run->dest_gfn);
+            num_subpages = ACCESS_ONCE(run->num_subpages);
+            offset += sizeof(*run);
+
+            if ( !num_subpages || offset + num_subpages * sizeof(xom_subpage_write_info) > PAGE_SIZE )
+                break;
+            if ( dest_gfn > p2m->max_mapped_pfn ) {
+                ret = -EOVERFLOW;
+                break;
+            }
+
+            ret = write_subpages(d, _gfn(dest_gfn), (const xom_subpage_write_info*) (src_page + offset), num_subpages);
+            if (ret < 0)
+                break;
+            offset += num_subpages * sizeof(xom_subpage_write_info);
+        }
+
+        unmap_domain_page(src_page);
+        put_page(page);
+        if (ret < 0)
+            return ret;
+
+        if ( xom_range_preempt(i, i + 1, nr_pages) )
+            return i + 1;
     }
 
-    // Execute command
-    gfn_lock(p2m, gfn_dest, 0);
-    page = get_page_from_gfn(d, gfn_x(gfn_dest), NULL, P2M_ALLOC);
-    if(!page){
-        gfn_unlock(p2m, gfn_dest, 0);
+    return 0;
+}
+
+/*
+ * Scrubs the subpages of gfn in subpage_mask and unlocks them, so that they can be written again.
+ * The page stays executable, so the subpages are filled with int3 to trap stale pointers into them.
+ */
+static int free_subpages(struct domain* d, gfn_t gfn, uint32_t subpage_mask){
+    unsigned int i;
+    uint32_t lock_status;
+    char* xom_page;
+    struct page_info *page;
+    void **subpage_slot;
+
+    subpage_slot = radix_tree_lookup_slot(&d->xom_subpages, gfn_x(gfn));
+    if(!subpage_slot)
+        return -EINVAL;
+    lock_status = get_subpage_lock_status(subpage_slot);
+
+    // Only locked subpages can be freed
+    if(!subpage_mask || (subpage_mask & ~lock_status))
+        return -EINVAL;
+
+    page = get_page_from_gfn(d, gfn_x(gfn), NULL, P2M_ALLOC);
+    if(!page)
         return -EINVAL;
-    }
     if (!get_page_type(page, PGT_writable_page)) {
         put_page(page);
-        gfn_unlock(p2m, gfn_dest, 0);
         return -EPERM;
     }
     xom_page = (char*) __map_domain_page(page);
-    for(i = 0; i < command.num_subpages; i++){
-        write_dest = xom_page + (command.write_info[i].target_subpage * SUBPAGE_SIZE);
-        memcpy(write_dest, command.write_info[i].data, SUBPAGE_SIZE);
-        subpage_info->info.lock_status |= 1 << command.write_info[i].target_subpage;
+    for(i = 0; i < PAGE_SIZE / SUBPAGE_SIZE; i++){
+        if(subpage_mask & (1u << i))
+            memset(xom_page + i * SUBPAGE_SIZE, 0xcc, SUBPAGE_SIZE);
     }
+    set_subpage_lock_status(subpage_slot, lock_status & ~subpage_mask);
     unmap_domain_page(xom_page);
-    gfn_unlock(p2m, gfn_dest, 0);
     put_page_and_type(page);
 
     return 0;
 }
 
 static int mark_reg_clear_page(struct domain* d, gfn_t gfn, unsigned int reg_clear_type) {
-    xom_page_info* page_info;
+    int ret;
     struct p2m_domain *p2m;
     p2m_type_t ptype;
     p2m_access_t atype;
 
-    if(!reg_clear_type || reg_clear_type > REG_CLEAR_TYPE_FULL)
+    if(!reg_clear_desc_valid(reg_clear_type))
         return -EINVAL;
 
     // A page cannot be marked twice
-    page_info = get_page_info_entry(&d->xom_reg_clear_pages, gfn);
-    if(page_info)
+    if(radix_tree_lookup(&d->xom_reg_clear_pages, gfn_x(gfn)))
         return -EINVAL;
 
     // We only allow marking XOM pages
     p2m = p2m_get_hostp2m(d);
-    gfn_lock(p2m, c_gfn, 0);
     p2m->get_entry(p2m, gfn, &ptype, &atype, 0, NULL, NULL);
-    gfn_unlock(p2m, c_gfn, 0);
     if (atype != p2m_access_x)
         return -EINVAL;
 
 
-    page_info = add_page_info_entry(&d->xom_reg_clear_pages, gfn, (info_spec_t){.reg_clear_type = reg_clear_type});
-    if (!page_info)
-        return -ENOMEM;
+    // Readers may walk the tree concurrently, radix_tree_insert publishes the new slot with RCU semantics
+    ret = radix_tree_insert(&d->xom_reg_clear_pages, gfn_x(gfn), radix_tree_int_to_ptr(reg_clear_type));
+    if (ret < 0)
+        return ret;
 
+    reg_clear_pages_changed(d, 1);
     return 0;
 }
 
+/*
+ * Processes a batch of XOM mmuext ops. xom_page_lock and the p2m lock are taken once for the
+ * whole batch, so the EPT changes of all ops are flushed by a single p2m_unlock().
+ * On return, *done holds the number of completed ops. If -ERESTART is returned, the caller
+ * has to create a continuation for the remaining ops. An op that was preempted in the middle
+ * of its range is rewritten in guest memory to cover only the remaining pages.
+ */
 int handle_xom_seal(struct vcpu* curr,
-                    XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, XEN_GUEST_HANDLE_PARAM(uint) pdone) {
-    int rc;
+                    XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, unsigned int *done) {
+    long rc = 0;
     unsigned int i;
     struct domain* d = curr->domain;
+    struct p2m_domain *p2m;
     struct mmuext_op op;
 
+    *done = 0;
+
     if (!is_hvm_domain(d) || !hap_enabled(d))
         return -EOPNOTSUPP;
 
+    p2m = p2m_get_hostp2m(d);
+
+    spin_lock(&d->xom_page_lock);
+    p2m_lock(p2m);
+
     for ( i = 0; i < count; i++ ) {
         if (curr->arch.old_guest_table || (i && hypercall_preempt_check())) {
-            gdprintk(XENLOG_ERR, "Preempt check failed\n");
-            return -ERESTART;
+            rc = -ERESTART;
+            break;
         }
 
         if (unlikely(__copy_from_guest(&op, uops, 1) != 0)) {
             gdprintk(XENLOG_ERR, "Unable to copy guest page\n");
-            return -EFAULT;
+            rc = -EFAULT;
+            break;
         }
 
-        spin_lock(&d->xom_page_lock);
         switch (op.cmd){
             case MMUEXT_MARK_XOM:
                 rc = set_xom_seal(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
@@ -406,71 +561,74 @@ int handle_xom_seal(struct vcpu* curr,
             case MMUEXT_WRITE_XOM_SPAGES:
                 rc = write_into_subpage(d, _gfn(op.arg1.mfn), _gfn(op.arg2.src_mfn));
                 break;
+            case MMUEXT_WRITE_XOM_SPAGES_MULTI:
+                rc = write_into_subpages_multi(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
+                break;
+            case MMUEXT_FREE_XOM_SPAGES:
+                rc = free_subpages(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
+                break;
             case MMUEXT_MARK_REG_CLEAR:
                 rc =  mark_reg_clear_page(d, _gfn(op.arg1.mfn), op.arg2.nr_ents);
                 break;
             default:
                 rc = -EOPNOTSUPP;
         }
-        spin_unlock(&d->xom_page_lock);
 
-        guest_handle_add_offset(uops, 1);
+        if (rc > 0) {
+            // Preempted within the range, resume with the pages that are left
+            op.arg1.mfn += rc;
+            op.arg2.nr_ents -= rc;
+            rc = unlikely(__copy_to_guest(uops, &op, 1)) ? -EFAULT : -ERESTART;
+        }
         if (rc < 0)
-            return rc;
-    }
-
-    if ( unlikely(!guest_handle_is_null(pdone)) )
-        copy_to_guest(pdone, &i, 1);
-    return 0;
-}
+            break;
 
-static void free_xom_info_node(struct rb_node *node) {
-    xom_page_info *data;
+        guest_handle_add_offset(uops, 1);
+    }
 
-    if (!node)
-        return;
+    // Flushes the TLBs once for every EPT change made by this batch
+    p2m_unlock(p2m);
+    spin_unlock(&d->xom_page_lock);
 
-    data = rb_entry(node, xom_page_info, node);
-    
-    if (node->rb_left)
-        free_xom_info_node(node->rb_left);
-    if (node->rb_right)
-        free_xom_info_node(node->rb_right);
-    
-    xfree(data);
+    *done = i;
+    return rc;
 }
 
-void free_xom_info(struct rb_root* root) {
-    if (root->rb_node)
-        free_xom_info_node(root->rb_node);
-    
-    *root = RB_ROOT;    
+void free_xom_info(struct domain* d) {
+    radix_tree_destroy(&d->xom_subpages, NULL);
+    radix_tree_destroy(&d->xom_reg_clear_pages, NULL);
+    atomic_set(&d->xom_nr_reg_clear_pages, 0);
 }
 
-static inline unsigned long gfn_of_rip(const unsigned long rip) {
-    struct vcpu *curr = current;
+static inline unsigned long linear_rip(struct vcpu *curr, const unsigned long rip) {
     struct segment_register sreg;
-    uint32_t pfec = PFEC_page_present | PFEC_insn_fetch | PFEC_user_mode;
-    unsigned long ret;
-
-    if ( unlikely(!curr || !~(uintptr_t)curr) )
-        return gfn_x(INVALID_GFN);
-
-    if ( unlikely(!curr->is_initialised) )
-        return gfn_x(INVALID_GFN);
 
     hvm_get_segment_register(curr, x86_seg_cs, &sreg);
+    return sreg.base + rip;
+}
+
+static inline unsigned long gfn_of_linear(struct vcpu *curr, const unsigned long va) {
+    uint32_t pfec = PFEC_page_present | PFEC_insn_fetch | PFEC_user_mode;
+    unsigned long ret;
 
     vmx_vmcs_enter(curr);
-    ret = paging_gva_to_gfn(curr, sreg.base + rip, &pfec);
+    ret = paging_gva_to_gfn(curr, va, &pfec);
     vmx_vmcs_exit(curr);
 
     return ret;
 }
 
+/*
+ * Runs at the end of every VM exit from guest user mode:
+ *  - Domains without any marked page return without walking the guest page tables.
+ *  - Otherwise the instruction page is translated on every call. With HAP, Xen sees neither
+ *    guest PTE changes nor a page table root reused under the same CR3, so no earlier
+ *    translation can be trusted and the walk cannot be skipped.
+ *  - The gfn is looked up in xom_reg_clear_pages under RCU rather than xom_page_lock.
+ */
 unsigned char get_reg_clear_type(const struct cpu_user_regs* const regs) {
     unsigned char ret = REG_CLEAR_TYPE_NONE;
-    xom_page_info* info;
+    void* entry;
     gfn_t instr_gfn;
     struct vcpu* v = current;
     struct domain * const d = v->domain;
@@ -481,17 +639,24 @@ unsigned char get_reg_clear_type(const struct cpu_user_regs* const regs) {
     if (!is_hvm_domain(d) || !hap_enabled(d))
         return ret;
 
-    instr_gfn = _gfn(gfn_of_rip(regs->rip));
-    if ( unlikely(gfn_eq(instr_gfn, INVALID_GFN)) )
+    if ( !atomic_read(&d->xom_nr_reg_clear_pages) )
         return ret;
 
-    spin_lock(&d->xom_page_lock);
+    if ( unlikely(!v->is_initialised) )
+        return ret;
 
-    info = get_page_info_entry(&d->xom_reg_clear_pages, instr_gfn);
-    if(info)
-        ret = info->info.reg_clear_type;
+    perfc_incr(xom_reg_clear_walk);
+    instr_gfn = _gfn(gfn_of_linear(v, linear_rip(v, regs->rip) & PAGE_MASK));
+    if ( unlikely(gfn_eq(instr_gfn, INVALID_GFN)) )
+        return ret;
+
+    // Never contend with other vCPUs or with a hypercall holding xom_page_lock
+    rcu_read_lock(&xom_reg_clear_rcu_lock);
+    entry = radix_tree_lookup(&d->xom_reg_clear_pages, gfn_x(instr_gfn));
+    if(entry)
+        ret = (unsigned char) radix_tree_ptr_to_int(entry);
+    rcu_read_unlock(&xom_reg_clear_rcu_lock);
 
-    spin_unlock(&d->xom_page_lock);
     return ret;
 }
 
@@ -640,8 +640,8 @@ struct domain *domain_create(domid_t domid,
 #endif
 #ifdef CONFIG_HVM
     spin_lock_init(&d->xom_page_lock);
-    d->xom_subpages = RB_ROOT;
-    d->xom_reg_clear_pages = RB_ROOT;
+    radix_tree_init(&d->xom_subpages);
+    radix_tree_init(&d->xom_reg_clear_pages);
 #endif
 
 
@@ -1182,8 +1182,7 @@ static void cf_check complete_domain_destroy(struct rcu_head *head)
     xfree(d->vm_event_share);
 #endif
 #if CONFIG_HVM
-    free_xom_info(&d->xom_subpages);
-    free_xom_info(&d->xom_reg_clear_pages);
+    free_xom_info(d);
 #endif
 
     for ( i = d->max_vcpus - 1; i >= 0; i-- )
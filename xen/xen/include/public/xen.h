@@ -402,6 +402,26 @@ DEFINE_XEN_GUEST_HANDLE(xen_ulong_t);
  *
  * cmd: MMUEXT_[UN]MARK_SUPER
  * mfn: Machine frame number of head of superpage to be [un]marked.
+ *
+ * cmd: MMUEXT_[UN]MARK_XOM, MMUEXT_CREATE_XOM_SPAGES
+ * mfn: Guest frame number of the first page of the range.
+ * nr_ents: Number of pages in the range.
+ * Large ranges may be preempted. The op is then rewritten in place to cover
+ * only the remaining pages before the hypercall is continued.
+ *
+ * cmd: MMUEXT_WRITE_XOM_SPAGES_MULTI
+ * mfn: Guest frame number of the first source page.
+ * nr_ents: Number of source pages. Each source page holds a sequence of runs,
+ *          every run writing subpages of one destination page.
+ *
+ * cmd: MMUEXT_MARK_REG_CLEAR
+ * mfn: Guest frame number of an XOM page.
+ * nr_ents: Register-clear descriptor. Bits 0-3 select the GPRs to clear,
+ *          bits 4-5 the widest vector registers used by the page.
+ *
+ * cmd: MMUEXT_FREE_XOM_SPAGES
+ * mfn: Guest frame number of a subpage XOM page.
+ * nr_ents: Bitmask of the locked subpages to scrub and unlock.
  */
 /* ` enum mmuext_cmd { */
 #define MMUEXT_PIN_L1_TABLE      0
@@ -430,6 +450,8 @@ DEFINE_XEN_GUEST_HANDLE(xen_ulong_t);
 #define MMUEXT_WRITE_XOM_SPAGES  24
 #define MMUEXT_GET_SECRET_PAGE 25
 #define MMUEXT_MARK_REG_CLEAR 26
+#define MMUEXT_WRITE_XOM_SPAGES_MULTI 27
+#define MMUEXT_FREE_XOM_SPAGES 28
 
 /* ` } */
 
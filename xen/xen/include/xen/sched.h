@@ -604,8 +604,12 @@ struct domain
 #endif
 #ifdef CONFIG_HVM
     spinlock_t xom_page_lock;
-    struct rb_root xom_subpages;
-    struct rb_root xom_reg_clear_pages;
+    /* gfn -> subpage lock bitmap. Only used under xom_page_lock */
+    struct radix_tree_root xom_subpages;
+    /* gfn -> reg clear type. Updated under xom_page_lock, read under RCU */
+    struct radix_tree_root xom_reg_clear_pages;
+    /* Read without xom_page_lock on every VM exit */
+    atomic_t xom_nr_reg_clear_pages;
 #endif
 
     /* Holding CDF_* constant. Internal flags for domain creation. */
@@ -5,26 +5,44 @@
 #define REG_CLEAR_TYPE_VECTOR   1
 #define REG_CLEAR_TYPE_FULL     2
 
+/*
+ * A register-clear descriptor holds the type of GPR clearing in its low nibble, and the widest
+ * vector registers the marked code uses in bits 4-5. REG_CLEAR_WIDTH_WIDEST clears everything
+ * the CPU has, which is what descriptors without a width always did.
+ */
+#define REG_CLEAR_TYPE_MASK     0x0f
+#define REG_CLEAR_WIDTH_MASK    0x30
+#define REG_CLEAR_WIDTH_WIDEST  0x00
+#define REG_CLEAR_WIDTH_SSE     0x10
+#define REG_CLEAR_WIDTH_AVX     0x20
+#define REG_CLEAR_WIDTH_AVX512  0x30
+
+#define reg_clear_gprs(desc)    ((desc) & REG_CLEAR_TYPE_MASK)
+#define reg_clear_width(desc)   ((desc) & REG_CLEAR_WIDTH_MASK)
+#define reg_clear_desc_valid(desc) \
+    (!((desc) & ~(REG_CLEAR_TYPE_MASK | REG_CLEAR_WIDTH_MASK)) && \
+     reg_clear_gprs(desc) != REG_CLEAR_TYPE_NONE && reg_clear_gprs(desc) <= REG_CLEAR_TYPE_FULL)
+
 // Do not call without backing up SSE registers !!
 extern void aes_gctr_linear(void *icb, void* x, void *y, unsigned int num_blocks);
 
 #ifdef CONFIG_HVM
 int handle_xom_seal(struct vcpu* curr,
-        XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, XEN_GUEST_HANDLE_PARAM(uint) pdone);
-void free_xom_info(struct rb_root *root);
+        XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, unsigned int *done);
+void free_xom_info(struct domain *d);
 unsigned char get_reg_clear_type(const struct cpu_user_regs* regs);
 
 #else
 static inline int handle_xom_seal (struct vcpu* curr,
-        XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, XEN_GUEST_HANDLE_PARAM(uint) pdone){
+        XEN_GUEST_HANDLE_PARAM(mmuext_op_t) uops, unsigned int count, unsigned int *done){
     (void) curr;
     (void) uops;
     (void) count;
-    (void) pdone;
+    *done = 0;
     return -EOPNOTSUPP;
 }
 
-static inline void free_xom_info(struct rb_root *root) {(void)root;}
+static inline void free_xom_info(struct domain *d) {(void)d;}
 static inline unsigned char get_reg_clear_type(const struct cpu_user_regs* regs) {(void) regs; return REG_CLEAR_TYPE_NONE;}
 
 #endif